@@ -0,0 +1,475 @@
+// Allocator benchmark, linked against one engine at a time (malloc_1.cpp .. malloc_4.cpp, or malloc_libc.cpp for the
+// C library's malloc) as the bench_<engine> targets. Prints one JSON object per workload:
+//     {"engine":"malloc_4","workload":"uniform-lifo","ops":200000,"seconds":0.0102,"ops_per_sec":19607843,
+//      "p50_ns":31,"p99_ns":92,"p999_ns":1210,"peak_rss_kb":10412}
+// Usage: bench_<engine> [-n ops] [workload...]
+//
+// Every workload runs in a child process so it starts with a fresh heap and gets its own peak RSS. It runs twice: an
+// untimed pass for the throughput, then a pass timing each operation for the latency percentiles (which include the
+// ~20ns of reading the clock). Sizes and free orders are generated before either pass, and the bookkeeping is mmap'd,
+// so nothing but the engine touches the heap while it runs (malloc_2/3 assume they own the program break).
+
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <mutex>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "bench.h"
+
+// malloc_1 .. malloc_3 keep their state in unlocked globals, so the threaded workloads take a lock around them
+#ifndef BENCH_THREAD_SAFE
+#define BENCH_THREAD_SAFE 0
+#endif
+#define DEFAULT_OPS 200000
+#define LIVE_BLOCKS 1024
+#define RING_SIZE 1024
+
+using namespace std;
+
+enum Needs {
+    NEEDS_FREE = 1,
+    NEEDS_CALLOC = 2,
+    NEEDS_REALLOC = 4,
+};
+
+/**
+ * xorshift64*, so every engine sees the exact same sizes and orders
+ */
+class Random {
+    uint64_t state;
+
+public:
+    explicit Random(uint64_t seed) : state(seed) {}
+
+    uint64_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 2685821657736338717ULL;
+    }
+
+    size_t uniform(size_t low, size_t high) {
+        return low + next() % (high - low + 1);
+    }
+
+    /**
+     * @return A number in (0, 1]
+     */
+    double unit() {
+        return (double) ((next() >> 11) + 1) / (double) (1ULL << 53);
+    }
+};
+
+/**
+ * Runs every operation as is, for the throughput pass
+ */
+class Untimed {
+public:
+    template <typename F>
+    void time(F op) {
+        op();
+    }
+
+    Untimed at(size_t) {
+        return *this;
+    }
+};
+
+/**
+ * Everything a workload needs, generated before it runs. `ops` counts every call into the engine
+ */
+struct Plan {
+    size_t ops;
+    size_t *sizes;
+    size_t *order;
+    void **slots;
+};
+
+static void fill_uniform(Plan &plan, size_t low, size_t high) {
+    Random random(1);
+    for (size_t i = 0; i < plan.ops; i++) {
+        plan.sizes[i] = random.uniform(low, high);
+    }
+}
+
+/**
+ * Pareto distributed sizes: mostly tiny, with a long tail reaching past the mmap threshold
+ */
+static void fill_power_law(Plan &plan) {
+    Random random(2);
+    for (size_t i = 0; i < plan.ops; i++) {
+        plan.sizes[i] = (size_t) min(16 / pow(random.unit(), 1 / 0.8), (double) (1 << 20));
+    }
+}
+
+/**
+ * Which live block each step of a steady state workload replaces
+ */
+static void fill_random_order(Plan &plan) {
+    Random random(3);
+    for (size_t i = 0; i < plan.ops; i++) {
+        plan.order[i] = random.next() % LIVE_BLOCKS;
+    }
+}
+
+/**
+ * Allocates LIVE_BLOCKS blocks, frees them all (newest first, oldest first or shuffled), and again
+ */
+template <typename Timer>
+static size_t run_batches(Timer &timer, Plan &plan, int free_order) {
+    size_t done = 0;
+    Random random(4);
+    while (done + 2 * LIVE_BLOCKS <= plan.ops) {
+        for (size_t i = 0; i < LIVE_BLOCKS; i++) {
+            size_t size = plan.sizes[done + i];
+            timer.time([&] { plan.slots[i] = smalloc(size); });
+            touch(plan.slots[i], size);
+        }
+        for (size_t i = 0; i < LIVE_BLOCKS; i++) {
+            plan.order[i] = free_order < 0 ? LIVE_BLOCKS - 1 - i : i;
+        }
+        if (free_order == 0) {
+            for (size_t i = LIVE_BLOCKS - 1; i > 0; i--) {
+                swap(plan.order[i], plan.order[random.next() % (i + 1)]);
+            }
+        }
+        for (size_t i = 0; i < LIVE_BLOCKS; i++) {
+            void *p = plan.slots[plan.order[i]];
+            timer.time([&] { sfree(p); });
+        }
+        done += 2 * LIVE_BLOCKS;
+    }
+    return done;
+}
+
+/**
+ * Keeps LIVE_BLOCKS blocks alive, replacing a random one at every step
+ */
+template <typename Timer>
+static size_t run_steady(Timer &timer, Plan &plan, bool zeroed) {
+    size_t done = 0;
+    memset(plan.slots, 0, LIVE_BLOCKS * sizeof(void *));
+    for (size_t i = 0; done + 2 <= plan.ops; i++) {
+        void *&slot = plan.slots[plan.order[i]];
+        size_t size = plan.sizes[i];
+        if (slot) {
+            void *p = slot;
+            timer.time([&] { sfree(p); });
+            done++;
+        }
+        if (zeroed) {
+            timer.time([&] { slot = scalloc(size / 8, 8); });
+        } else {
+            timer.time([&] { slot = smalloc(size); });
+        }
+        touch(slot, size / 8 * 8);
+        done++;
+    }
+    for (size_t i = 0; i < LIVE_BLOCKS; i++) {
+        if (plan.slots[i]) {
+            sfree(plan.slots[i]);
+        }
+    }
+    return done;
+}
+
+template <typename Timer>
+static size_t run_lifo(Timer &timer, Plan &plan) {
+    return run_batches(timer, plan, -1);
+}
+
+template <typename Timer>
+static size_t run_fifo(Timer &timer, Plan &plan) {
+    return run_batches(timer, plan, 1);
+}
+
+template <typename Timer>
+static size_t run_random(Timer &timer, Plan &plan) {
+    return run_steady(timer, plan, false);
+}
+
+template <typename Timer>
+static size_t run_calloc(Timer &timer, Plan &plan) {
+    return run_steady(timer, plan, true);
+}
+
+/**
+ * Allocations that are never freed, the only thing malloc_1 can do. Keep the op count modest: it all stays mapped
+ */
+template <typename Timer>
+static size_t run_alloc_only(Timer &timer, Plan &plan) {
+    for (size_t i = 0; i < plan.ops; i++) {
+        size_t size = plan.sizes[i];
+        void *p;
+        timer.time([&] { p = smalloc(size); });
+        touch(p, size);
+    }
+    return plan.ops;
+}
+
+/**
+ * A few buffers growing side by side by half their size at a time, like vectors being appended to, up to 256KB (past
+ * the mmap threshold) before starting over
+ */
+template <typename Timer>
+static size_t run_realloc_growth(Timer &timer, Plan &plan) {
+    const size_t buffers = 4;
+    size_t sizes[buffers] = {};
+    memset(plan.slots, 0, buffers * sizeof(void *));
+    size_t done = 0;
+    for (size_t i = 0; done + 2 <= plan.ops; i++) {
+        void *&slot = plan.slots[i % buffers];
+        size_t &size = sizes[i % buffers];
+        if (size >= 256 * 1024) {
+            void *p = slot;
+            timer.time([&] { sfree(p); });
+            slot = nullptr;
+            size = 0;
+            done++;
+        }
+        size = size ? size + size / 2 : 16;
+        void *p = slot;
+        timer.time([&] { slot = srealloc(p, size); });
+        touch(slot, size);
+        done++;
+    }
+    for (size_t i = 0; i < buffers; i++) {
+        if (plan.slots[i]) {
+            sfree(plan.slots[i]);
+        }
+    }
+    return done;
+}
+
+static std::mutex engine_lock;
+
+/**
+ * Serializes calls into engines which aren't thread safe, and is nothing for the others
+ */
+class EngineGuard {
+#if not BENCH_THREAD_SAFE
+    std::lock_guard<std::mutex> guard;
+
+public:
+    EngineGuard() : guard(engine_lock) {}
+#else
+public:
+    EngineGuard() {}
+#endif
+};
+
+/**
+ * A fixed size queue between one producer and one consumer thread
+ */
+struct Ring {
+    void *blocks[RING_SIZE];
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+};
+
+template <typename Timer>
+struct Producer {
+    Timer timer;
+    Plan *plan;
+    Ring *ring;
+
+    static void *run(void *arg) {
+        auto *self = (Producer *) arg;
+        Plan &plan = *self->plan;
+        Ring &ring = *self->ring;
+        for (size_t i = 0; i < plan.ops / 2; i++) {
+            size_t size = plan.sizes[i];
+            void *p;
+            self->timer.time([&] {
+                EngineGuard guard;
+                p = smalloc(size);
+            });
+            touch(p, size);
+            size_t tail = ring.tail.load(std::memory_order_relaxed);
+            while (tail - ring.head.load(std::memory_order_acquire) == RING_SIZE) {
+                sched_yield();
+            }
+            ring.blocks[tail % RING_SIZE] = p;
+            ring.tail.store(tail + 1, std::memory_order_release);
+        }
+        return nullptr;
+    }
+};
+
+/**
+ * One thread allocates, the other frees everything it allocated: every free is of another thread's block.
+ * The thread is created with pthread rather than std::thread, which would allocate with the C library's malloc
+ */
+template <typename Timer>
+static size_t run_producer_consumer(Timer &timer, Plan &plan) {
+    Ring *ring = scratch<Ring>(1);
+    Producer<Timer> producer = {timer.at(0), &plan, ring};
+    Timer consumer = timer.at(plan.ops / 2);
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, Producer<Timer>::run, &producer) != 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < plan.ops / 2; i++) {
+        size_t head = ring->head.load(std::memory_order_relaxed);
+        while (ring->tail.load(std::memory_order_acquire) == head) {
+            sched_yield();
+        }
+        void *p = ring->blocks[head % RING_SIZE];
+        ring->head.store(head + 1, std::memory_order_release);
+        consumer.time([&] {
+            EngineGuard guard;
+            sfree(p);
+        });
+    }
+    pthread_join(thread, nullptr);
+    return plan.ops / 2 * 2;
+}
+
+struct Workload {
+    const char *name;
+    int needs;
+    void (*prepare)(Plan &);
+    size_t (*run)(Untimed &, Plan &);
+    size_t (*run_timed)(Timed &, Plan &);
+};
+
+static void prepare_small(Plan &plan) {
+    fill_uniform(plan, 16, 1024);
+}
+
+static void prepare_small_random(Plan &plan) {
+    fill_uniform(plan, 16, 1024);
+    fill_random_order(plan);
+}
+
+static void prepare_power_law(Plan &plan) {
+    fill_power_law(plan);
+    fill_random_order(plan);
+}
+
+static void prepare_calloc(Plan &plan) {
+    fill_uniform(plan, 16, 4096);
+    fill_random_order(plan);
+}
+
+static void prepare_tiny(Plan &plan) {
+    fill_uniform(plan, 16, 256);
+}
+
+static void prepare_nothing(Plan &) {}
+
+#define WORKLOAD(name, needs, prepare, run) {name, needs, prepare, run<Untimed>, run<Timed>}
+
+static const Workload workloads[] = {
+        WORKLOAD("alloc-only", 0, prepare_tiny, run_alloc_only),
+        WORKLOAD("uniform-lifo", NEEDS_FREE, prepare_small, run_lifo),
+        WORKLOAD("uniform-fifo", NEEDS_FREE, prepare_small, run_fifo),
+        WORKLOAD("uniform-random", NEEDS_FREE, prepare_small_random, run_random),
+        WORKLOAD("powerlaw-random", NEEDS_FREE, prepare_power_law, run_random),
+        WORKLOAD("realloc-growth", NEEDS_FREE | NEEDS_REALLOC, prepare_nothing, run_realloc_growth),
+        WORKLOAD("calloc-heavy", NEEDS_FREE | NEEDS_CALLOC, prepare_calloc, run_calloc),
+        WORKLOAD("producer-consumer", NEEDS_FREE, prepare_tiny, run_producer_consumer),
+};
+
+/**
+ * @return The missing function the workload needs, or nullptr if the engine has all of them
+ */
+static const char *missing_function(int needs) {
+    if ((needs & NEEDS_FREE) and not sfree) {
+        return "sfree";
+    }
+    if ((needs & NEEDS_CALLOC) and not scalloc) {
+        return "scalloc";
+    }
+    if ((needs & NEEDS_REALLOC) and not srealloc) {
+        return "srealloc";
+    }
+    return nullptr;
+}
+
+/**
+ * Runs a single workload, in the child process
+ */
+static void run_workload(const Workload &workload, size_t ops) {
+    Plan plan = {ops, scratch<size_t>(ops), scratch<size_t>(max(ops, (size_t) LIVE_BLOCKS)),
+                 scratch<void *>(LIVE_BLOCKS)};
+    uint32_t *samples = scratch<uint32_t>(ops);
+    workload.prepare(plan);
+    memset(samples, 0, ops * sizeof(uint32_t));
+    reset_peak_rss();
+
+    Untimed untimed;
+    uint64_t start = now_ns();
+    size_t done = workload.run(untimed, plan);
+    double seconds = (now_ns() - start) / 1e9;
+
+    Timed timed(samples);
+    size_t timed_done = workload.run_timed(timed, plan);
+    if (done == 0 or timed_done != done) {
+        emit("{\"engine\":\"%s\",\"workload\":\"%s\",\"error\":\"ran %zu of %zu operations\"}\n", BENCH_ENGINE,
+             workload.name, min(done, timed_done), ops);
+        return;
+    }
+    size_t rss = peak_rss_kb();
+    uint32_t p50 = percentile(samples, done, 0.5);
+    uint32_t p99 = percentile(samples, done, 0.99);
+    uint32_t p999 = percentile(samples, done, 0.999);
+    emit("{\"engine\":\"%s\",\"workload\":\"%s\",\"ops\":%zu,\"seconds\":%.6f,\"ops_per_sec\":%.0f,"
+         "\"p50_ns\":%u,\"p99_ns\":%u,\"p999_ns\":%u,\"peak_rss_kb\":%zu}\n",
+         BENCH_ENGINE, workload.name, done, seconds, done / seconds, p50, p99, p999, rss);
+}
+
+static bool selected(const char *name, int argc, char **argv, int first) {
+    if (first == argc) {
+        return true;
+    }
+    for (int i = first; i < argc; i++) {
+        if (strcmp(argv[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char **argv) {
+    size_t ops = DEFAULT_OPS;
+    int first = 1;
+    if (argc > 2 and strcmp(argv[1], "-n") == 0) {
+        ops = strtoul(argv[2], nullptr, 10);
+        first = 3;
+    }
+    if (ops < 2 * LIVE_BLOCKS) {
+        emit("usage: %s [-n ops (at least %d)] [workload...]\n", argv[0], 2 * LIVE_BLOCKS);
+        return 1;
+    }
+
+    int failures = 0;
+    for (const Workload &workload : workloads) {
+        if (not selected(workload.name, argc, argv, first)) {
+            continue;
+        }
+        const char *missing = missing_function(workload.needs);
+        if (missing) {
+            emit("{\"engine\":\"%s\",\"workload\":\"%s\",\"skipped\":\"no %s\"}\n", BENCH_ENGINE, workload.name,
+                 missing);
+            continue;
+        }
+        pid_t child = fork();
+        if (child == 0) {
+            run_workload(workload, ops);
+            _exit(0);
+        }
+        int status = 0;
+        if (child < 0 or waitpid(child, &status, 0) < 0) {
+            emit("{\"engine\":\"%s\",\"workload\":\"%s\",\"error\":\"%s\"}\n", BENCH_ENGINE, workload.name,
+                 strerror(errno));
+            failures++;
+        } else if (WIFSIGNALED(status)) {
+            emit("{\"engine\":\"%s\",\"workload\":\"%s\",\"error\":\"killed by signal %d\"}\n", BENCH_ENGINE,
+                 workload.name, WTERMSIG(status));
+            failures++;
+        }
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,135 @@
+// Helpers shared by the benchmark and the trace replayer, which are linked against one allocator engine at a time
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef BENCH_ENGINE
+#define BENCH_ENGINE "unknown"
+#endif
+
+void *smalloc(size_t size);
+// malloc_1 only has smalloc, so the others are weak (nullptr when missing) and what needs a missing one is skipped
+void *scalloc(size_t num, size_t size) __attribute__((weak));
+void sfree(void *p) __attribute__((weak));
+void *srealloc(void *oldp, size_t size) __attribute__((weak));
+
+/**
+ * Writes straight to stdout: stdio's buffer would be allocated with the C library's malloc, and output still buffered
+ * at a fork would be printed twice
+ */
+static void emit(const char *format, ...) {
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length > 0 and write(STDOUT_FILENO, line, std::min((size_t) length, sizeof(line) - 1)) < 0) {
+        _exit(2);
+    }
+}
+
+static uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Memory for the bookkeeping, which is never freed (the process exits when done)
+ */
+template <typename T>
+static T *scratch(size_t count) {
+    void *p = mmap(nullptr, count * sizeof(T), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        emit("{\"engine\":\"%s\",\"error\":\"out of memory\"}\n", BENCH_ENGINE);
+        _exit(1);
+    }
+    return (T *) p;
+}
+
+/**
+ * Writes to the block like a real user would, so its pages are actually faulted in
+ */
+static void touch(void *p, size_t size) {
+    if (p) {
+        ((volatile char *) p)[0] = 1;
+        ((volatile char *) p)[size - 1] = 1;
+    }
+}
+
+/**
+ * Records how long every operation took
+ */
+class Timed {
+    uint32_t *samples;
+
+public:
+    explicit Timed(uint32_t *samples) : samples(samples) {}
+
+    template <typename F>
+    void time(F op) {
+        uint64_t start = now_ns();
+        op();
+        uint64_t elapsed = now_ns() - start;
+        *samples++ = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t) elapsed;
+    }
+
+    /**
+     * @return A recorder writing `offset` samples further on, for another thread
+     */
+    Timed at(size_t offset) {
+        return Timed(samples + offset);
+    }
+};
+
+/**
+ * Clears the peak RSS the kernel tracks, so it's measured from here on. Older kernels don't support it, and the peak
+ * then includes the benchmark's setup
+ */
+static void reset_peak_rss() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0) {
+        if (write(fd, "5", 1) < 0) {
+            // Keep the peak since the process started
+        }
+        close(fd);
+    }
+}
+
+/**
+ * @return The peak resident memory in KB, or 0 if it can't be read
+ */
+static size_t peak_rss_kb() {
+    char status[4096];
+    int fd = open("/proc/self/status", O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t length = read(fd, status, sizeof(status) - 1);
+    close(fd);
+    if (length <= 0) {
+        return 0;
+    }
+    status[length] = '\0';
+    const char *line = strstr(status, "VmHWM:");
+    return line ? strtoul(line + strlen("VmHWM:"), nullptr, 10) : 0;
+}
+
+static uint32_t percentile(uint32_t *samples, size_t count, double fraction) {
+    size_t index = std::min((size_t) (count * fraction), count - 1);
+    std::nth_element(samples, samples + index, samples + count);
+    return samples[index];
+}
+
+#endif
@@ -0,0 +1,23 @@
+// The C library's malloc behind the smalloc interface, as the baseline engine of the benchmark (bench_libc)
+
+#include <cstdlib>
+
+void *smalloc(size_t size) {
+    return malloc(size);
+}
+
+void *scalloc(size_t num, size_t size) {
+    return calloc(num, size);
+}
+
+void sfree(void *p) {
+    free(p);
+}
+
+void *srealloc(void *oldp, size_t size) {
+    return realloc(oldp, size);
+}
+
+void *saligned_alloc(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
@@ -0,0 +1,314 @@
+// Plays an allocation trace (recorded by malloc_4 built with ALLOC_TRACE, see smalloc_trace_start) back against one
+// engine, linked as the replay_<engine> targets like the benchmark. Prints a JSON object:
+//     {"engine":"malloc_4","records":120000,"ops":119870,"threads":3,"seconds":0.0075,"ops_per_sec":15982666,
+//      "p50_ns":35,"p99_ns":140,"p999_ns":1800,"peak_rss_kb":20480,"failed_ops":0,"emulated_ops":0,
+//      "skipped_records":130}
+// Usage: replay_<engine> trace-file
+//
+// The replay is deterministic: the records of every thread are merged by time and played back on a single thread.
+// Pointers are turned into slots of a table before the replay, so the replay itself only calls the engine.
+// Records which can't be played back are skipped: failed allocations, and frees or reallocations of blocks allocated
+// before the recording started. Operations the engine lacks are emulated with smalloc (calloc is smalloc and memset,
+// realloc a new block which nothing is copied to, aligned allocation an unaligned one, and free does nothing).
+// Every operation is timed, so `seconds` includes reading the clock. Like the benchmark, the replay runs in a child
+// process, so an engine crashing on the trace prints {"engine":...,"error":"killed by signal N"} instead.
+
+#include <cerrno>
+#include <sys/wait.h>
+#include <unordered_map>
+#include <vector>
+#include "bench.h"
+// Only for the trace format, the engine is whichever the replayer is linked against
+#include "../malloc_4.h"
+
+void *saligned_alloc(size_t alignment, size_t size) __attribute__((weak));
+
+using namespace std;
+
+struct Record {
+    MallocTraceOp op;
+    uint64_t thread;
+    uint64_t time;
+    uint64_t args[3];
+};
+
+/**
+ * An operation of the replay: the slot of the block it allocates, resizes or frees, and its sizes
+ */
+struct Step {
+    MallocTraceOp op;
+    uint32_t slot;
+    size_t first;
+    size_t second;
+};
+
+static bool get_varint(const unsigned char *&in, const unsigned char *end, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; in < end and shift < 64; shift += 7) {
+        unsigned char byte = *in++;
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        if (not(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @return The number of arguments a record of the operation has, or 0 for an unknown operation
+ */
+static int num_of_args(int op) {
+    switch (op) {
+        case MALLOC_TRACE_FREE:
+            return 1;
+        case MALLOC_TRACE_MALLOC:
+            return 2;
+        case MALLOC_TRACE_CALLOC:
+        case MALLOC_TRACE_REALLOC:
+        case MALLOC_TRACE_ALIGNED:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Reads every record of a trace. A trace cut short (by a crash, or a full disk) is read up to its last whole record
+ * @return false if the file can't be read or isn't a trace
+ */
+static bool read_trace(const char *path, vector<Record> &records) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    vector<unsigned char> data;
+    unsigned char chunk[64 * 1024];
+    ssize_t length;
+    while ((length = read(fd, chunk, sizeof(chunk))) > 0) {
+        data.insert(data.end(), chunk, chunk + length);
+    }
+    close(fd);
+    size_t magic_length = strlen(SMALLOC_TRACE_MAGIC);
+    if (length < 0 or data.size() < magic_length or memcmp(data.data(), SMALLOC_TRACE_MAGIC, magic_length) != 0) {
+        return false;
+    }
+    const unsigned char *in = data.data() + magic_length;
+    const unsigned char *end = data.data() + data.size();
+    while (in < end) {
+        Record record = {};
+        int op = *in++;
+        int args = num_of_args(op);
+        bool whole = args != 0 and get_varint(in, end, record.thread) and get_varint(in, end, record.time);
+        for (int i = 0; whole and i < args; i++) {
+            whole = get_varint(in, end, record.args[i]);
+        }
+        if (not whole) {
+            break;
+        }
+        record.op = (MallocTraceOp) op;
+        records.push_back(record);
+    }
+    return true;
+}
+
+/**
+ * Turns the records into the steps of the replay, giving every live block a slot
+ * @return The number of slots the replay needs
+ */
+static size_t plan_replay(const vector<Record> &records, vector<Step> &steps) {
+    unordered_map<uint64_t, uint32_t> live;
+    vector<uint32_t> free_slots;
+    uint32_t num_of_slots = 0;
+    auto take_slot = [&](uint64_t address) {
+        uint32_t slot;
+        if (free_slots.empty()) {
+            slot = num_of_slots++;
+        } else {
+            slot = free_slots.back();
+            free_slots.pop_back();
+        }
+        // An address still live was freed by a record which is later in time (it lost a race across threads), and
+        // the old block stays allocated in the replay
+        live[address] = slot;
+        return slot;
+    };
+
+    for (const Record &record : records) {
+        switch (record.op) {
+            case MALLOC_TRACE_MALLOC:
+                if (record.args[1]) {
+                    steps.push_back({record.op, take_slot(record.args[1]), record.args[0], 0});
+                }
+                break;
+            case MALLOC_TRACE_CALLOC:
+            case MALLOC_TRACE_ALIGNED:
+                if (record.args[2]) {
+                    steps.push_back({record.op, take_slot(record.args[2]), record.args[0], record.args[1]});
+                }
+                break;
+            case MALLOC_TRACE_REALLOC: {
+                if (not record.args[2]) {
+                    break;
+                }
+                auto old_block = live.find(record.args[0]);
+                if (old_block == live.end()) {
+                    steps.push_back({MALLOC_TRACE_MALLOC, take_slot(record.args[2]), record.args[1], 0});
+                    break;
+                }
+                uint32_t slot = old_block->second;
+                live.erase(old_block);
+                live[record.args[2]] = slot;
+                steps.push_back({record.op, slot, record.args[1], 0});
+                break;
+            }
+            case MALLOC_TRACE_FREE: {
+                auto block = live.find(record.args[0]);
+                if (block != live.end()) {
+                    steps.push_back({record.op, block->second, 0, 0});
+                    free_slots.push_back(block->second);
+                    live.erase(block);
+                }
+                break;
+            }
+        }
+    }
+    return num_of_slots;
+}
+
+struct ReplayResult {
+    size_t num_of_failed;
+    size_t num_of_emulated;
+};
+
+/**
+ * Plays the steps back, timing every one
+ */
+static ReplayResult replay(const Step *steps, size_t count, void **slots, Timed &timer) {
+    ReplayResult result = {0, 0};
+    for (size_t i = 0; i < count; i++) {
+        const Step &step = steps[i];
+        void *&slot = slots[step.slot];
+        void *p = nullptr;
+        size_t size = step.first;
+        switch (step.op) {
+            case MALLOC_TRACE_MALLOC:
+                timer.time([&] { p = smalloc(step.first); });
+                break;
+            case MALLOC_TRACE_CALLOC:
+                size = step.first * step.second;
+                if (scalloc) {
+                    timer.time([&] { p = scalloc(step.first, step.second); });
+                } else {
+                    timer.time([&] {
+                        p = smalloc(size);
+                        if (p) {
+                            memset(p, 0, size);
+                        }
+                    });
+                    result.num_of_emulated++;
+                }
+                break;
+            case MALLOC_TRACE_ALIGNED:
+                size = step.second;
+                if (saligned_alloc) {
+                    timer.time([&] { p = saligned_alloc(step.first, step.second); });
+                } else {
+                    timer.time([&] { p = smalloc(step.second); });
+                    result.num_of_emulated++;
+                }
+                break;
+            case MALLOC_TRACE_REALLOC:
+                if (not slot) {
+                    // The block failed to allocate earlier in the replay
+                    timer.time([&] { p = smalloc(step.first); });
+                } else if (srealloc) {
+                    timer.time([&] { p = srealloc(slot, step.first); });
+                    if (!p) {
+                        // The block stays where it was, like after a failed srealloc of the recording
+                        result.num_of_failed++;
+                        continue;
+                    }
+                } else {
+                    timer.time([&] { p = smalloc(step.first); });
+                    result.num_of_emulated++;
+                }
+                break;
+            case MALLOC_TRACE_FREE:
+                if (sfree) {
+                    timer.time([&] { sfree(slot); });
+                } else {
+                    timer.time([] {});
+                    result.num_of_emulated++;
+                }
+                slot = nullptr;
+                continue;
+        }
+        if (!p) {
+            result.num_of_failed++;
+        }
+        touch(p, size);
+        slot = p;
+    }
+    return result;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        emit("usage: %s trace-file\n", argv[0]);
+        return 1;
+    }
+    vector<Record> records;
+    if (not read_trace(argv[1], records)) {
+        emit("{\"engine\":\"%s\",\"error\":\"can't read a trace from %s\"}\n", BENCH_ENGINE, argv[1]);
+        return 1;
+    }
+    stable_sort(records.begin(), records.end(), [](const Record &a, const Record &b) { return a.time < b.time; });
+    uint64_t num_of_threads = 0;
+    for (const Record &record : records) {
+        num_of_threads = max(num_of_threads, record.thread + 1);
+    }
+    vector<Step> plan;
+    size_t num_of_slots = plan_replay(records, plan);
+    size_t count = plan.size();
+    if (count == 0) {
+        emit("{\"engine\":\"%s\",\"error\":\"no operations to replay\"}\n", BENCH_ENGINE);
+        return 1;
+    }
+
+    // Nothing but the engine may use the heap during the replay, so everything it needs is mmap'd up front
+    Step *steps = scratch<Step>(count);
+    copy(plan.begin(), plan.end(), steps);
+    void **slots = scratch<void *>(num_of_slots);
+    uint32_t *samples = scratch<uint32_t>(count);
+    memset(samples, 0, count * sizeof(uint32_t));
+
+    pid_t child = fork();
+    if (child == 0) {
+        reset_peak_rss();
+        Timed timer(samples);
+        uint64_t start = now_ns();
+        ReplayResult result = replay(steps, count, slots, timer);
+        double seconds = (now_ns() - start) / 1e9;
+
+        size_t rss = peak_rss_kb();
+        uint32_t p50 = percentile(samples, count, 0.5);
+        uint32_t p99 = percentile(samples, count, 0.99);
+        uint32_t p999 = percentile(samples, count, 0.999);
+        emit("{\"engine\":\"%s\",\"records\":%zu,\"ops\":%zu,\"threads\":%llu,\"seconds\":%.6f,"
+             "\"ops_per_sec\":%.0f,\"p50_ns\":%u,\"p99_ns\":%u,\"p999_ns\":%u,\"peak_rss_kb\":%zu,\"failed_ops\":%zu,"
+             "\"emulated_ops\":%zu,\"skipped_records\":%zu}\n",
+             BENCH_ENGINE, records.size(), count, (unsigned long long) num_of_threads, seconds, count / seconds,
+             p50, p99, p999, rss, result.num_of_failed, result.num_of_emulated, records.size() - count);
+        _exit(0);
+    }
+    int status = 0;
+    if (child < 0 or waitpid(child, &status, 0) < 0) {
+        emit("{\"engine\":\"%s\",\"error\":\"%s\"}\n", BENCH_ENGINE, strerror(errno));
+        return 1;
+    }
+    if (WIFSIGNALED(status)) {
+        emit("{\"engine\":\"%s\",\"error\":\"killed by signal %d\"}\n", BENCH_ENGINE, WTERMSIG(status));
+        return 1;
+    }
+    return WEXITSTATUS(status);
+}
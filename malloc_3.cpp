@@ -7,6 +7,20 @@
 #define KB 1024
 #define NUM_OF_BUCKETS 128
 #define MIN_SPLIT_BLOCK_SIZE_BYTES 128
+// Checks the invariants of the blocks in the accessors of MallocMetadata and the buckets (such as never touching the
+// bucket links of an allocated or mmap'd block), throwing when one is broken. Checked by default, so the tests run
+// fully validated; builds with -DNDEBUG or -fno-exceptions leave the checks out, and -DCHECK_BLOCKS=0 or 1 picks
+// explicitly
+#ifndef CHECK_BLOCKS
+#if defined(NDEBUG) or not defined(__cpp_exceptions)
+#define CHECK_BLOCKS 0
+#else
+#define CHECK_BLOCKS 1
+#endif
+#endif
+#if CHECK_BLOCKS and not defined(__cpp_exceptions)
+#error "The checked build throws when a block is broken, so it needs exceptions"
+#endif
 // Fail safe. Cap max bucket. This will force the max ret value to be the last bucket (it works without it but just in case)
 #define SIZE_TO_BUCKET(X) (((X) / NUM_OF_BUCKETS / KB) >= NUM_OF_BUCKETS ? (NUM_OF_BUCKETS - 1) : ((X) / NUM_OF_BUCKETS / KB))
 #define EXCEPTION(name)                                  \
@@ -33,6 +47,28 @@ EXCEPTION(StillAllocatedException);
 
 EXCEPTION(InvalidForMmapAllocations);
 
+/**
+ * The policy of the invariant checks, picked by CHECK_BLOCKS. The checked policy throws `Exception` when a check
+ * fails, the unchecked one trusts the callers and compiles every check away
+ */
+template<bool Checked>
+struct BlockChecks {
+    template<class Exception>
+    static void require(bool, const char *) {}
+};
+
+template<>
+struct BlockChecks<true> {
+    template<class Exception>
+    static void require(bool holds, const char *message) {
+        if (not holds) {
+            throw Exception(message);
+        }
+    }
+};
+
+typedef BlockChecks<CHECK_BLOCKS != 0> Checks;
+
 class MallocMetadata {
     struct {
         unsigned int is_free: 1;
@@ -84,12 +120,9 @@ public:
     void setFree();
 
     void setAllocated() {
-        if (this->flags.is_mmap) {
-            throw InvalidForMmapAllocations("Can't set an mmap allocated block as allocated (you should init the block as allocated)");
-        }
-        if (not this->isFree()) {
-            throw StillAllocatedException("Can't allocate a block which is already allocated");
-        }
+        Checks::require<InvalidForMmapAllocations>(not this->flags.is_mmap,
+                "Can't set an mmap allocated block as allocated (you should init the block as allocated)");
+        Checks::require<StillAllocatedException>(this->isFree(), "Can't allocate a block which is already allocated");
         num_of_free_blocks--;
         num_of_allocated_blocks++;
         num_of_free_bytes -= this->getSize();
@@ -113,12 +146,10 @@ public:
      * @param next The next block in the bucket
      */
     void setNextBucketBlock(MallocMetadata *next) {
-        if (this->flags.is_mmap) {
-            throw InvalidForMmapAllocations("Can't set the next bucket block for mmap block");
-        }
-        if (not this->isFree()) {
-            throw StillAllocatedException("Can't set the next bucket block while the block for an allocated block");
-        }
+        Checks::require<InvalidForMmapAllocations>(not this->flags.is_mmap,
+                "Can't set the next bucket block for mmap block");
+        Checks::require<StillAllocatedException>(this->isFree(),
+                "Can't set the next bucket block while the block for an allocated block");
         this->next_bucket_block = next;
         if (next) {
             next->prev_bucket_block = this;
@@ -126,12 +157,10 @@ public:
     }
 
     void setPrevBucketBlock(MallocMetadata *new_prev) {
-        if (this->flags.is_mmap) {
-            throw InvalidForMmapAllocations("Can't set the previous bucket block for mmap block");
-        }
-        if (not this->isFree()) {
-            throw StillAllocatedException("Can't set the new_prev bucket block while the block for an allocated block");
-        }
+        Checks::require<InvalidForMmapAllocations>(not this->flags.is_mmap,
+                "Can't set the previous bucket block for mmap block");
+        Checks::require<StillAllocatedException>(this->isFree(),
+                "Can't set the new_prev bucket block while the block for an allocated block");
         this->prev_bucket_block = new_prev;
         if (new_prev) {
             new_prev->next_bucket_block = this;
@@ -139,42 +168,30 @@ public:
     }
 
     MallocMetadata *getNextBucketBlock() {
-        if (this->flags.is_mmap) {
-            throw InvalidForMmapAllocations("Can't get the next bucket block for mmap block");
-        }
-        if (not this->isFree()) {
-            throw StillAllocatedException("Can't get the next bucket block of an allocated block");
-        }
+        Checks::require<InvalidForMmapAllocations>(not this->flags.is_mmap,
+                "Can't get the next bucket block for mmap block");
+        Checks::require<StillAllocatedException>(this->isFree(),
+                "Can't get the next bucket block of an allocated block");
         return this->next_bucket_block;
     }
 
     MallocMetadata *getPrevBucketBlock() {
-        if (this->flags.is_mmap) {
-            throw InvalidForMmapAllocations("Can't get the previous bucket block for mmap block");
-        }
-        if (not this->isFree()) {
-            throw StillAllocatedException("Can't get the prev_in_heap bucket block of an allocated block");
-        }
+        Checks::require<InvalidForMmapAllocations>(not this->flags.is_mmap,
+                "Can't get the previous bucket block for mmap block");
+        Checks::require<StillAllocatedException>(this->isFree(),
+                "Can't get the prev_in_heap bucket block of an allocated block");
         return this->prev_bucket_block;
     }
 
     void *getBucketPtr() {
-        if (this->flags.is_mmap) {
-            throw InvalidForMmapAllocations("Can't get the bucket for an mmap block");
-        }
-        if (not this->isFree()) {
-            throw StillAllocatedException("Can't get the bucket of an allocated block");
-        }
+        Checks::require<InvalidForMmapAllocations>(not this->flags.is_mmap, "Can't get the bucket for an mmap block");
+        Checks::require<StillAllocatedException>(this->isFree(), "Can't get the bucket of an allocated block");
         return this->bucket_ptr;
     }
 
     void setBucketPtr(void *bucket) {
-        if (this->flags.is_mmap) {
-            throw InvalidForMmapAllocations("Can't set the bucket for an mmap block");
-        }
-        if (not this->isFree()) {
-            throw StillAllocatedException("Can't set the bucket of an allocated block");
-        }
+        Checks::require<InvalidForMmapAllocations>(not this->flags.is_mmap, "Can't set the bucket for an mmap block");
+        Checks::require<StillAllocatedException>(this->isFree(), "Can't set the bucket of an allocated block");
         this->bucket_ptr = bucket;
     }
 
@@ -265,12 +282,9 @@ void MallocMetadata::init(size_t new_size, MallocMetadata *new_prev, bool new_is
 }
 
 void Bucket::addBlock(MallocMetadata *block) {
-    if (block->isMmap()) {
-        throw InvalidForMmapAllocations("Can't add to bucket a block that was allocated using mmap");
-    }
-    if (not block->isFree()) {
-        throw StillAllocatedException("Can't add an allocated block to bucket");
-    }
+    Checks::require<InvalidForMmapAllocations>(not block->isMmap(),
+            "Can't add to bucket a block that was allocated using mmap");
+    Checks::require<StillAllocatedException>(block->isFree(), "Can't add an allocated block to bucket");
     block->setBucketPtr(this);
 
     if (this->list_head == nullptr) {
@@ -387,13 +401,10 @@ void MallocMetadata::mergeWithAdjacent() {
 }
 
 void MallocMetadata::removeSelfFromBucketChain() {
-    if (this->flags.is_mmap) {
-        throw InvalidForMmapAllocations("Can't remove blocks that were allocated using mmap from bucket");
-    }
-    if (not this->isFree()) {
-        throw StillAllocatedException(
-                "Can't remove a block which isn't free from bucket chain. The block can't possibly be in a bucket chain");
-    }
+    Checks::require<InvalidForMmapAllocations>(not this->flags.is_mmap,
+            "Can't remove blocks that were allocated using mmap from bucket");
+    Checks::require<StillAllocatedException>(this->isFree(),
+            "Can't remove a block which isn't free from bucket chain. The block can't possibly be in a bucket chain");
     MallocMetadata *prev = this->getPrevBucketBlock();
     MallocMetadata *next = this->getNextBucketBlock();
     if (prev) {
@@ -501,11 +512,18 @@ void sfree(void *p) {
 }
 
 void *scalloc(size_t num, size_t size) {
-    void *block = smalloc(num * size);
+    size_t total_size;
+    if (__builtin_mul_overflow(num, size, &total_size)) {
+        return nullptr;
+    }
+    void *block = smalloc(total_size);
     if (not block) {
         return nullptr;
     }
-    memset(block, 0, num * size);
+    // A fresh mapping is already zeroed
+    if (not(((MallocMetadata *) block) - 1)->isMmap()) {
+        memset(block, 0, total_size);
+    }
     return block;
 }
 
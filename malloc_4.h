@@ -0,0 +1,269 @@
+#include <unistd.h>
+
+#ifndef MALLOC4
+#define MALLOC4
+
+void *smalloc(size_t size);
+void *scalloc(size_t num, size_t size);
+void sfree(void *p);
+void *srealloc(void *oldp, size_t size);
+size_t _num_free_blocks();
+size_t _num_free_bytes();
+size_t _num_allocated_blocks();
+size_t _num_allocated_bytes();
+size_t _num_meta_data_bytes();
+size_t _size_meta_data();
+
+/**
+ * Gives the free memory at the top of every heap back to the OS, keeping `pad` bytes free at the top of each
+ * @return 1 if any memory was released, 0 otherwise
+ */
+int strim(size_t pad);
+
+/**
+ * Allocates `count` blocks of `size` bytes at once, carving them from a single free region when possible
+ * @param out_ptrs Set to the allocated blocks
+ * @return The number of blocks allocated, which is less than `count` only if memory ran out
+ */
+size_t smalloc_batch(size_t size, size_t count, void **out_ptrs);
+
+/**
+ * Frees `count` blocks at once (null pointers are skipped), merging blocks which are next to each other in the heap
+ * before freeing them
+ */
+void sfree_batch(void **ptrs, size_t count);
+
+/**
+ * Frees a block allocated with `size` bytes (as passed to smalloc or the last srealloc, or as returned by
+ * smalloc_at_least or the last sexpand), which tells whether the block is mapped without looking at it. Blocks from
+ * saligned_alloc are freed with sfree
+ */
+void sfree_sized(void *p, size_t size);
+
+/**
+ * Allocates a block whose address is a multiple of `alignment`, which has to be a power of two. Freed with sfree
+ * @return The block, or nullptr on failure or if the alignment isn't a power of two
+ */
+void *saligned_alloc(size_t alignment, size_t size);
+
+/**
+ * Like saligned_alloc, with the interface of posix_memalign. The alignment has to be a power of two multiple of
+ * sizeof(void *)
+ * @return 0 on success, EINVAL for an invalid alignment or ENOMEM if memory ran out
+ */
+int sposix_memalign(void **memptr, size_t alignment, size_t size);
+
+/**
+ * Grows a block without ever moving it: into the free block after it, at the top of the heap, or by growing its
+ * mapping in place. The block gets `preferred_size` bytes if it can, and at least `min_size` bytes otherwise
+ * @return The size of the block now (at least `min_size`), or 0 if it couldn't grow enough (the block is untouched)
+ */
+size_t sexpand(void *p, size_t min_size, size_t preferred_size);
+
+/**
+ * @return The number of bytes usable at `p`, which may be more than it was allocated with, or 0 if `p` is nullptr
+ */
+size_t smalloc_usable_size(void *p);
+
+/**
+ * Like smalloc, but the block is at least `size` bytes and all of it is the caller's, including any slack the
+ * allocator would have wasted (such as the rest of the last page of an mmap'd block)
+ * @param actual If not null, set to the size of the block
+ */
+void *smalloc_at_least(size_t size, size_t *actual);
+
+/**
+ * @return The bytes currently given back to the OS from inside free heap blocks, and all the bytes ever given back
+ */
+size_t _num_purged_bytes();
+size_t _num_total_purged_bytes();
+
+/**
+ * @return The bytes of the heaps and of mmap'd blocks set up to be backed by huge pages (0 unless built with
+ * -DHUGE_PAGES=1)
+ */
+size_t _num_huge_page_bytes();
+
+// Free blocks are grouped in power of two size classes: class 0 holds blocks below 128 bytes, and class i > 0 holds
+// blocks of [2^(i + 6), 2^(i + 7)) bytes
+#define SMALLOC_NUM_SIZE_CLASSES 58
+
+struct MallocSizeClassStats {
+    size_t num_of_free_blocks;
+    size_t num_of_free_bytes;
+};
+
+struct MallocStats {
+    // Blocks in use (unlike _num_allocated_blocks, which counts free blocks too), including mmap'd blocks and slab
+    // objects
+    size_t num_of_allocated_blocks;
+    size_t num_of_allocated_bytes;
+    size_t num_of_free_blocks;
+    size_t num_of_free_bytes;
+    size_t num_of_meta_data_bytes;
+    size_t num_of_slab_objects;
+    size_t num_of_slab_bytes;
+    // Free blocks of every size class. Free blocks of 8 bytes are too small to be indexed and aren't counted here
+    MallocSizeClassStats size_classes[SMALLOC_NUM_SIZE_CLASSES];
+    size_t largest_free_block;
+    // The part of the free bytes outside of the largest free block, from 0 (all free memory is usable by a single
+    // allocation) to 1
+    double fragmentation;
+    // Where the memory comes from: the heap grown with sbrk, and mappings (heap segments of secondary arenas and
+    // mmap'd blocks). Unmapped blocks kept for reuse are counted on their own
+    size_t num_of_sbrk_bytes;
+    size_t num_of_mmap_bytes;
+    size_t num_of_cached_mmap_bytes;
+    size_t num_of_purged_bytes;
+    size_t num_of_huge_page_bytes;
+    // Cumulative counters since the start of the process. The bytes requested by allocations and reallocations are
+    // compared with the bytes their blocks actually got, the difference being the slack inside the blocks
+    size_t num_of_allocs;
+    size_t num_of_frees;
+    size_t num_of_reallocs;
+    size_t num_of_requested_bytes;
+    size_t num_of_granted_bytes;
+    size_t num_of_splits;
+    size_t num_of_merges;
+};
+
+/**
+ * Fills `stats` with a snapshot of the allocator's state. It reads counters rather than walking the heap, except for
+ * the largest free block, found down the right spine of the treap of each arena's highest non empty bucket
+ */
+void smalloc_stats(struct MallocStats *stats);
+
+enum MallocBlockOrigin {
+    // A block of the main heap, grown with sbrk
+    MALLOC_ORIGIN_SBRK,
+    // A block of the heap of a secondary arena, which is carved from mapped segments
+    MALLOC_ORIGIN_SEGMENT,
+    // A block with a mapping of its own
+    MALLOC_ORIGIN_MMAP,
+    // A slot of a slab run
+    MALLOC_ORIGIN_SLAB
+};
+
+struct MallocBlockInfo {
+    // The address handed out for the block
+    void *address;
+    size_t size;
+    bool is_free;
+    enum MallocBlockOrigin origin;
+};
+
+typedef void (*MallocWalkCallback)(const struct MallocBlockInfo *block, void *ctx);
+
+/**
+ * Calls `callback` for every block: the blocks of each heap in address order, then the slots of the slab runs and
+ * the mmap'd blocks. Blocks held by thread caches are reported as allocated. The walk doesn't allocate, and holds
+ * the allocator's locks while calling `callback`, which must not allocate or free memory itself
+ */
+void sheap_walk(MallocWalkCallback callback, void *ctx);
+
+// A trace file is SMALLOC_TRACE_MAGIC followed by records: the operation (a byte), then as LEB128 varints the index
+// of the thread, the nanoseconds since the trace started and the operation's arguments:
+//     MALLOC_TRACE_MALLOC  size, result
+//     MALLOC_TRACE_CALLOC  num, size, result
+//     MALLOC_TRACE_REALLOC old pointer, size, result
+//     MALLOC_TRACE_FREE    pointer
+//     MALLOC_TRACE_ALIGNED alignment, size, result
+// Pointers are the addresses themselves, and a failed allocation's result is 0. Every thread buffers its records, so
+// records are in order for each thread but the threads' records are interleaved in chunks
+#define SMALLOC_TRACE_MAGIC "SMTRACE1"
+
+enum MallocTraceOp {
+    MALLOC_TRACE_MALLOC = 1,
+    MALLOC_TRACE_CALLOC,
+    MALLOC_TRACE_REALLOC,
+    MALLOC_TRACE_FREE,
+    MALLOC_TRACE_ALIGNED
+};
+
+/**
+ * Starts recording every allocation and free into a trace file at `path` (truncated if it exists), which bench/
+ * replay.cpp plays back. Only available when built with -DALLOC_TRACE=1, where setting the SMALLOC_TRACE environment
+ * variable to a path (in which "%p" stands for the process id) also starts recording at the first allocation.
+ * Recording stops at exit, and in forked children
+ * @return 0 on success, ENOSYS if built without tracing, EBUSY if already recording, or the error opening the file
+ */
+int smalloc_trace_start(const char *path);
+
+/**
+ * Stops recording, writing out what every thread has buffered
+ */
+void smalloc_trace_stop();
+
+enum MallocProfileEvent {
+    // Searches of the free block index for a block to allocate, and the buckets and bucket tree nodes they looked at
+    MALLOC_EVENT_BLOCK_SEARCHES,
+    MALLOC_EVENT_BUCKETS_SCANNED,
+    MALLOC_EVENT_NODES_VISITED,
+    MALLOC_EVENT_SPLITS,
+    // Freed heap blocks checked for free neighbours, and the neighbours actually merged
+    MALLOC_EVENT_MERGE_ATTEMPTS,
+    MALLOC_EVENT_MERGES,
+    MALLOC_EVENT_SBRK_CALLS,
+    // Calls to mmap and mremap
+    MALLOC_EVENT_MMAP_CALLS,
+    MALLOC_EVENT_MUNMAP_CALLS,
+    MALLOC_NUM_EVENTS
+};
+
+enum MallocProfileTimer {
+    MALLOC_TIMER_MALLOC,
+    MALLOC_TIMER_FREE,
+    MALLOC_TIMER_CALLOC,
+    MALLOC_TIMER_REALLOC,
+    // Finding (and splitting) a free block in the index, and merging a freed block with its neighbours
+    MALLOC_TIMER_BLOCK_SEARCH,
+    MALLOC_TIMER_MERGE,
+    MALLOC_NUM_TIMERS
+};
+
+// Bin i of a cycle histogram counts the calls which took [2^i, 2^(i + 1)) cycles (bin 0 those of 0 or 1 cycle), and
+// the last bin every call which took longer
+#define SMALLOC_PROFILE_NUM_BINS 32
+
+struct MallocProfile {
+    // Whether the allocator was built with -DPROFILE_HOT_PATHS=1. Everything else is 0 otherwise
+    bool enabled;
+    size_t events[MALLOC_NUM_EVENTS];
+    // The calls of every timer by the cycles they took (read with rdtsc, or nanoseconds where there is no time stamp
+    // counter), and the cycles of all of them
+    size_t cycles[MALLOC_NUM_TIMERS][SMALLOC_PROFILE_NUM_BINS];
+    size_t total_cycles[MALLOC_NUM_TIMERS];
+};
+
+/**
+ * Fills `profile` with the counters of the hot paths since the start of the process (or the last
+ * smalloc_profile_reset). Counting only happens in builds with -DPROFILE_HOT_PATHS=1
+ */
+void smalloc_profile(struct MallocProfile *profile);
+
+/**
+ * Sets the counters of the hot paths back to 0
+ */
+void smalloc_profile_reset();
+
+enum MallocOption {
+    // The alignment of every block: 8 or 16 bytes, and not below the alignment the allocator was built with
+    SMALLOC_OPT_ALIGNMENT = 1,
+    // Allocations of at least this many bytes get a mapping of their own: 4 KB to 32 MB
+    SMALLOC_OPT_MMAP_THRESHOLD,
+    // Blocks are only split when the leftover would have at least this many bytes: 16 bytes to 32 MB
+    SMALLOC_OPT_MIN_SPLIT_SIZE,
+    // The largest allocation, up to 2^47 bytes
+    SMALLOC_OPT_MAX_SIZE
+};
+
+/**
+ * Sets a parameter of the allocator. Parameters are only tunable at startup, before any memory is allocated; the
+ * SMALLOC_OPTIONS environment variable sets them too, as name=value pairs separated by colons (the names being
+ * alignment, mmap_threshold, min_split_size and max_size, as in "mmap_threshold=262144:alignment=16")
+ * @return 0 on success, EINVAL for an unknown parameter or a value out of its range, or EBUSY once memory was
+ * allocated
+ */
+int smallopt(int param, size_t value);
+
+#endif
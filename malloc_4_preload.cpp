@@ -0,0 +1,99 @@
+// Exports the C library's allocation functions on top of malloc_4, so existing binaries can run on it:
+//     LD_PRELOAD=./libmalloc4.so ./program
+// Built as the malloc4 target, with 16 byte alignment and no MAX_SIZE limit to behave like the C library's malloc.
+// Nothing here needs the dynamic linker (no dlsym of the real malloc), so there is nothing to bootstrap: malloc_4's
+// state is constant initialized (check_constant_initialization in malloc_4.cpp doesn't compile otherwise) and usable
+// from the very first call, made by other libraries' constructors before malloc_4.cpp's own initializers run. Every
+// function of the malloc family that allocates or frees is replaced, as mixing them with the C library's ones would
+// hand its blocks to sfree.
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <malloc.h>
+#include <unistd.h>
+#include "malloc_4.h"
+
+extern "C" {
+
+void *malloc(size_t size) noexcept {
+    // Unlike smalloc, malloc(0) returns a unique pointer
+    void *p = smalloc(size ? size : 1);
+    if (!p) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void free(void *p) noexcept {
+    sfree(p);
+}
+
+void *calloc(size_t num, size_t size) noexcept {
+    void *p = num and size ? scalloc(num, size) : scalloc(1, 1);
+    if (!p) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void *realloc(void *oldp, size_t size) noexcept {
+    if (oldp and size == 0) {
+        sfree(oldp);
+        return nullptr;
+    }
+    void *p = srealloc(oldp, size ? size : 1);
+    if (!p) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void *reallocarray(void *oldp, size_t num, size_t size) noexcept {
+    size_t total_size;
+    if (__builtin_mul_overflow(num, size, &total_size)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return realloc(oldp, total_size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) noexcept {
+    return sposix_memalign(memptr, alignment, size ? size : 1);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) noexcept {
+    void *p = saligned_alloc(alignment, size ? size : 1);
+    if (!p) {
+        errno = alignment and (alignment & (alignment - 1)) == 0 ? ENOMEM : EINVAL;
+    }
+    return p;
+}
+
+void *memalign(size_t alignment, size_t size) noexcept {
+    return aligned_alloc(alignment, size);
+}
+
+void *valloc(size_t size) noexcept {
+    return aligned_alloc(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) noexcept {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    // Rounding up to a page would wrap around to 0
+    if (size > SIZE_MAX - (page_size - 1)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return aligned_alloc(page_size, (size + page_size - 1) & ~(page_size - 1));
+}
+
+size_t malloc_usable_size(void *p) noexcept {
+    return smalloc_usable_size(p);
+}
+
+int malloc_trim(size_t pad) noexcept {
+    return strim(pad);
+}
+
+}
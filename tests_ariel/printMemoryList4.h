@@ -11,6 +11,7 @@
 //void printMemory4(void* start);
 
 #include <iostream>
+#include "../malloc_4.h"
 
 typedef struct stats_t {
     size_t num_free_blocks = 0;
@@ -21,28 +22,51 @@ typedef struct stats_t {
 } stats;
 
 
-template<class T>
+struct walk_t {
+    void *start;
+    bool print;
+    stats *current_stats;
+    size_t size;
+    int blocks;
+};
+
+// Only the blocks of the main heap from `start` (the header of a block) on are of interest. Slab objects are
+// counted as allocated blocks without metadata, as the allocator does, but aren't printed
+void walkHeapBlock(const MallocBlockInfo *block, void *ctx) {
+    walk_t *walk = (walk_t *) ctx;
+    if (block->origin == MALLOC_ORIGIN_SLAB and !block->is_free and walk->current_stats) {
+        walk->current_stats->num_allocated_blocks++;
+        walk->current_stats->num_allocated_bytes += block->size;
+    }
+    if (block->origin != MALLOC_ORIGIN_SBRK or (char *) block->address - _size_meta_data() < walk->start) {
+        return;
+    }
+    if (walk->print) {
+        std::cout << (block->is_free ? "|F:" : "|U:") << block->size;
+    }
+    walk->size += block->size;
+    walk->blocks++;
+    if (walk->current_stats) {
+        walk->current_stats->num_meta_data_bytes += _size_meta_data();
+        walk->current_stats->num_allocated_blocks++;
+        walk->current_stats->num_allocated_bytes += block->size;
+        if (block->is_free) {
+            walk->current_stats->num_free_blocks++;
+            walk->current_stats->num_free_bytes += block->size;
+        }
+    }
+}
+
 void printMemory(void *start, bool onlyList) {
-    T *current = (T *) start;
-    size_t size = 0;
-    int blocks = 0;
+    walk_t walk = {start, true, nullptr, 0, 0};
     if (!onlyList) {
         std::cout << "Printing Memory List\n";
     }
-    while (current) {
-        if (current->isFree()) {
-            std::cout << "|F:" << current->getSize();
-        } else {
-            std::cout << "|U:" << current->getSize();
-        }
-        size += current->getSize();
-        blocks++;
-        current = current->getNextInHeap();
-    }
+    sheap_walk(walkHeapBlock, &walk);
     std::cout << "|";
     if (!onlyList) {
-        std::cout << std::endl << "Memory Info:\nNumber Of Blocks: " << blocks << "\nTotal Size (without Metadata): " << size << std::endl;
-        std::cout << "Size of Metadata: " << sizeof(T) << std::endl;
+        std::cout << std::endl << "Memory Info:\nNumber Of Blocks: " << walk.blocks << "\nTotal Size (without Metadata): " << walk.size << std::endl;
+        std::cout << "Size of Metadata: " << _size_meta_data() << std::endl;
     }
 //	std::cout << std::endl;
 }
@@ -56,21 +80,11 @@ void resetStats(stats &current_stats) {
 }
 
 
-template<class T>
 void updateStats(void *start, stats &current_stats, size_t bytes_mmap, int blocks_mmap) {
     resetStats(current_stats);
-    T *current = static_cast<T *>(start);
-    while (current) {
-        current_stats.num_meta_data_bytes += sizeof(T) - sizeof(void *);
-        current_stats.num_allocated_blocks++;
-        current_stats.num_allocated_bytes += current->getSize();
-        if (current->isFree()) {
-            current_stats.num_free_blocks++;
-            current_stats.num_free_bytes += current->getSize();
-        }
-        current = current->getNextInHeap();
-    }
-    current_stats.num_meta_data_bytes += (sizeof(T) - sizeof(void *)) * blocks_mmap;
+    walk_t walk = {start, false, &current_stats, 0, 0};
+    sheap_walk(walkHeapBlock, &walk);
+    current_stats.num_meta_data_bytes += _size_meta_data() * blocks_mmap;
     current_stats.num_allocated_bytes += bytes_mmap;
     current_stats.num_allocated_blocks += blocks_mmap;
 }
@@ -4,11 +4,20 @@
 
 #include <cstdlib>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sstream>
 #include <sys/wait.h>
 #include <chrono>
+#include <fstream>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <new>
+#include <csignal>
 #include "printMemoryList4.h"
 #include "malloc_3.h"
+#include "../malloc_4.h"
 #include "colors.h"
 
 using namespace std;
@@ -19,67 +28,30 @@ using namespace std;
 
 #define TEST(X) string X (void *array[MAX_ALLOC])
 
-static int test_ind = 0;
-
-//if you see garbage when printing remove this line or comment it
-#define USE_COLORS
-
-// Copy your type here
-// don't change anything from the one in malloc_3.c !!not even the order of args!!!
-class MallocMetadata {
-    struct {
-        unsigned int is_free: 1;
-        unsigned int is_mmap: 1;
-    } flags;
-    size_t size;
-    MallocMetadata *prev_in_heap;
-    MallocMetadata *next_bucket_block;
-    MallocMetadata *prev_bucket_block;
-    void *bucket_ptr;
-    void *user_indicator;
-
-    void mergeWithAdjacent();
-
-public:
-    void init(size_t new_size, MallocMetadata *new_prev, bool new_is_free, bool is_mmap);
-
-    size_t getSize() const;
-
-    void setSize(size_t new_size);
-
-    bool isFree() const;
-
-    void setFree();
-
-    void setAllocated();
-
-    MallocMetadata *getPrevInHeap();
-
-    MallocMetadata *getNextInHeap();
-
-    void removeSelfFromBucketChain();
-
-    void setNextBucketBlock(MallocMetadata *next);
-
-    void setPrevBucketBlock(MallocMetadata *new_prev);
-
-    MallocMetadata *getNextBucketBlock();
-
-    MallocMetadata *getPrevBucketBlock();
-
-    void *getBucketPtr();
+// Returned by the tests that don't apply to the build
+const std::string skipped = "SKIPPED";
 
-    void setBucketPtr(void *bucket);
-
-    bool isMmap() const;
-
-    void destroy();
-
-    void *getUserDataAddress();
-};
+// The thread cache and the slabs keep small blocks out of the heap, so the tests of the exact heap layout are
+// skipped in the builds with either of them
+#if (defined(TCACHE_MAX_COUNT) && TCACHE_MAX_COUNT > 0) || (defined(SLAB_MAX_SIZE) && SLAB_MAX_SIZE > 0)
+#define REQUIRE_EXACT_LAYOUT() return skipped
+#else
+#define REQUIRE_EXACT_LAYOUT() do {} while (0)
+#endif
 
+// Builds with -DMMAP_CACHE_MAX_BYTES=0 unmap freed mappings at once, so the tests of the mmap cache are skipped there
+#if defined(MMAP_CACHE_MAX_BYTES) && MMAP_CACHE_MAX_BYTES == 0
+#define MMAP_CACHE_ENABLED 0
+#define REQUIRE_MMAP_CACHE() return skipped
+#else
+#define MMAP_CACHE_ENABLED 1
+#define REQUIRE_MMAP_CACHE() do {} while (0)
+#endif
 
+static int test_ind = 0;
 
+//if you see garbage when printing remove this line or comment it
+#define USE_COLORS
 
 ///////////////////////////////////////////////////
 
@@ -115,20 +87,19 @@ void checkStats(size_t bytes_mmap, int blocks_mmap, int line_number);
 
 
 TEST(testInit) {
+    REQUIRE_EXACT_LAYOUT();
     std::string expected = "|F:8||U:8|";
-    if (sizeof(MallocMetadata) - sizeof(void *) != _size_meta_data()) {
-        std::cout << "You didn't copy the metadata as is Or a bug in  _size_meta_data()" << std::endl;
-    }
-    printMemory<MallocMetadata>(memory_start_addr, true);
+    printMemory(memory_start_addr, true);
     checkStats(0, 0, __LINE__);
     DO_MALLOC(array[0] = smalloc(8));
     checkStats(0, 0, __LINE__);
-    printMemory<MallocMetadata>(memory_start_addr, true);
+    printMemory(memory_start_addr, true);
     return expected;
 }
 
 TEST(testAlignSanity) {
-    std::string expected = "|U:8|U:8||F:" + to_string(16 + size_of_metadata) + "||U:64|";
+    REQUIRE_EXACT_LAYOUT();
+    std::string expected = "|U:8|U:8||F:" + to_string(16 + size_of_metadata) + "||U:" + to_string(16 + size_of_metadata) + "|";
     DO_MALLOC(array[0] = smalloc(5));
     if (((size_t) (array[0])) % 8 != 0) {
         cout << "memory not aligned: " << (size_t) array[0];
@@ -136,30 +107,31 @@ TEST(testAlignSanity) {
     checkStats(0, 0, __LINE__);
     DO_MALLOC(array[1] = smalloc(3));
     checkStats(0, 0, __LINE__);
-    printMemory<MallocMetadata>(memory_start_addr, true);
+    printMemory(memory_start_addr, true);
     sfree(array[0]);
     sfree(array[1]);
     checkStats(0, 0, __LINE__);
-    printMemory<MallocMetadata>(memory_start_addr, true);
+    printMemory(memory_start_addr, true);
     DO_MALLOC(array[0] = smalloc(1));
-    printMemory<MallocMetadata>(memory_start_addr, true);
+    printMemory(memory_start_addr, true);
     return expected;
 }
 
 TEST(testAlignSplit) {
+    REQUIRE_EXACT_LAYOUT();
     const int split_size = 10 * 1024;
     const int unaligned_big = 501;
     const int alignment_padding_for_big = (8 - (unaligned_big % 8) % 8);
     string expected = "|U:" + to_string(split_size) + "|";
     DO_MALLOC(array[0] = smalloc(split_size));
-    printMemory<MallocMetadata>(memory_start_addr, true);
+    printMemory(memory_start_addr, true);
     checkStats(0, 0, __LINE__);
     sfree(array[0]);
-    printMemory<MallocMetadata>(memory_start_addr, true);
+    printMemory(memory_start_addr, true);
     expected += "|F:" + to_string(split_size) + "|";
     checkStats(0, 0, __LINE__);
     DO_MALLOC(array[0] = smalloc(unaligned_big));
-    printMemory<MallocMetadata>(memory_start_addr, true);
+    printMemory(memory_start_addr, true);
     expected += "|U:" + to_string(unaligned_big + alignment_padding_for_big) +
                 "|F:" + to_string(split_size - unaligned_big - alignment_padding_for_big - size_of_metadata) +
                 "|";
@@ -174,7 +146,7 @@ TEST(testAlignSplit) {
         }
     }
     expected += "|F:" + to_string(split_size - unaligned_big - alignment_padding_for_big - count * 8 - count * size_of_metadata - size_of_metadata) + "|";
-    printMemory<MallocMetadata>(memory_start_addr, true);
+    printMemory(memory_start_addr, true);
     checkStats(0, 0, __LINE__);
     return expected;
 }
@@ -198,80 +170,1025 @@ TEST(testAlignMmap) {
 }
 
 TEST(testAlignCalloc) {
+    REQUIRE_EXACT_LAYOUT();
     string expected = "|U:16||U:16|U:24|U:8|U:24|";
     DO_MALLOC(array[0] = scalloc(3, 3));
     checkStats(0, 0, __LINE__);
-    printMemory<MallocMetadata>(memory_start_addr, true);
+    printMemory(memory_start_addr, true);
     DO_MALLOC(array[1] = scalloc(3, 7));
     checkStats(0, 0, __LINE__);
     DO_MALLOC(array[1] = smalloc(7));
     checkStats(0, 0, __LINE__);
     DO_MALLOC(array[1] = scalloc(3, 7));
     checkStats(0, 0, __LINE__);
-    printMemory<MallocMetadata>(memory_start_addr, true);
+    printMemory(memory_start_addr, true);
     return expected;
 
 }
 
+// Fills a block with garbage before it's freed, so a block reusing its memory can't be zeroed by chance
+void dirtyBlock(void *p, size_t size) {
+    memset(p, 0xab, size);
+}
+
+bool isZeroed(void *p, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (((unsigned char *) p)[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+TEST(testCallocZeroed) {
+    string expected = "";
+    // Every block is bigger than the largest slab objects (1024 bytes), so they all come from the heap
+    // A free block reused from the buckets
+    DO_MALLOC(array[0] = smalloc(1500));
+    DO_MALLOC(array[1] = smalloc(2048));
+    dirtyBlock(array[0], 1500);
+    sfree(array[0]);
+    DO_MALLOC(array[2] = scalloc(15, 100));
+    if (array[2] != array[0] or !isZeroed(array[2], 1500)) {
+        cout << "a reused heap block wasn't zeroed";
+    }
+    // A free block at the top of the heap, which grows with fresh memory
+    DO_MALLOC(array[3] = smalloc(1500));
+    dirtyBlock(array[3], 1500);
+    sfree(array[3]);
+    DO_MALLOC(array[4] = scalloc(1, 5000));
+    if (array[4] != array[3] or !isZeroed(array[4], 5000)) {
+        cout << "a heap block grown at the top of the heap wasn't zeroed";
+    }
+    DO_MALLOC(array[5] = smalloc(2048));
+    checkStats(0, 0, __LINE__);
+    // Free blocks merged into one big enough to have its pages purged
+    for (int i = 6; i < 9; i++) {
+        DO_MALLOC(array[i] = smalloc(100000));
+        dirtyBlock(array[i], 100000);
+    }
+    DO_MALLOC(array[9] = smalloc(2048));
+    for (int i = 6; i < 9; i++) {
+        sfree(array[i]);
+    }
+    if (_num_purged_bytes() == 0) {
+        cout << "the merged free block wasn't purged";
+    }
+    DO_MALLOC(array[10] = scalloc(1, 120000));
+    if (array[10] != array[6] or !isZeroed(array[10], 120000)) {
+        cout << "a purged heap block wasn't zeroed";
+    }
+    checkStats(0, 0, __LINE__);
+#if MMAP_CACHE_ENABLED
+    // A mapping kept by the mmap cache
+    DO_MALLOC(array[11] = smalloc(size_for_mmap));
+    dirtyBlock(array[11], size_for_mmap);
+    sfree(array[11]);
+    MallocStats stats;
+    smalloc_stats(&stats);
+    if (stats.num_of_cached_mmap_bytes == 0) {
+        cout << "the freed mapping wasn't cached";
+    }
+    DO_MALLOC(array[12] = scalloc(size_for_mmap, 1));
+    if (array[12] != array[11] or !isZeroed(array[12], size_for_mmap)) {
+        cout << "a cached mapping wasn't zeroed";
+    }
+    sfree(array[12]);
+    checkStats(0, 0, __LINE__);
+#endif
+    return expected;
+}
+
 TEST(testAlignRealloc) {
+    REQUIRE_EXACT_LAYOUT();
     const int init_size = 400;
     const int eventual_free = init_size - 32 - 64 - size_of_metadata * 3 - 8;
+    const int eventual_size = eventual_free + 1 + (8 - (eventual_free + 1) % 8) % 8;
     string expected = "|U:" + to_string(init_size) + "|"
                       + "|F:" + to_string(init_size) + "|"
                       + "|U:8|U:32|F:" + to_string(init_size - 40 - size_of_metadata * 2) + "|"
                       + "|F:8|U:32|U:64|F:" + to_string(eventual_free) + "|"
-                      + "|F:8|U:32|U:64|U:160|"
-                      + "|F:8|U:32|U:64|F:160|";
+                      + "|F:8|U:32|U:64|U:" + to_string(eventual_size) + "|"
+                      + "|F:8|U:32|U:64|F:" + to_string(eventual_size) + "|";
 
     {
         DO_MALLOC(array[0] = smalloc(400 - 7));
         checkStats(0, 0, __LINE__);
-        printMemory<MallocMetadata>(memory_start_addr, true);
+        printMemory(memory_start_addr, true);
     }
     {
         sfree(array[0]);
         checkStats(0, 0, __LINE__);
-        printMemory<MallocMetadata>(memory_start_addr, true);
+        printMemory(memory_start_addr, true);
     }
     {
         DO_MALLOC(array[0] = smalloc(7));
         checkStats(0, 0, __LINE__);
         DO_MALLOC(array[1] = smalloc(28)); // Aligned to 32
         checkStats(0, 0, __LINE__);
-        printMemory<MallocMetadata>(memory_start_addr, true);
+        printMemory(memory_start_addr, true);
     }
     {
         DO_MALLOC(array[1] = srealloc(array[0], 60)); // Aligned to 64
         checkStats(0, 0, __LINE__);
-        printMemory<MallocMetadata>(memory_start_addr, true);
+        printMemory(memory_start_addr, true);
     }
     {
         DO_MALLOC(array[2] = smalloc(eventual_free + 1));
         checkStats(0, 0, __LINE__);
-        printMemory<MallocMetadata>(memory_start_addr, true);
+        printMemory(memory_start_addr, true);
     }
     {
         sfree(array[2]);
         checkStats(0, 0, __LINE__);
-        printMemory<MallocMetadata>(memory_start_addr, true);
+        printMemory(memory_start_addr, true);
     }
 
     return expected;
 }
 
+TEST(testTrim) {
+    const int big_size = 100 * 1024;
+    string expected = "";
+    DO_MALLOC(array[0] = smalloc(big_size));
+    checkStats(0, 0, __LINE__);
+    sfree(array[0]);
+    checkStats(0, 0, __LINE__);
+    char *break_before = (char *) sbrk(0);
+    if (strim(0) != 1) {
+        cout << "strim didn't release the free top of the heap";
+    }
+    if (break_before - (char *) sbrk(0) < big_size - 4096) {
+        cout << "program break wasn't lowered: " << to_string(break_before - (char *) sbrk(0));
+    }
+    checkStats(0, 0, __LINE__);
+    if (strim(0) != 0) {
+        cout << "strim released memory twice";
+    }
+    DO_MALLOC(array[0] = smalloc(big_size));
+    checkStats(0, 0, __LINE__);
+    return expected;
+}
+
+TEST(testBatch) {
+    REQUIRE_EXACT_LAYOUT();
+    const int count = 4;
+    const int batch_size = 24;
+    const int region_size = count * (batch_size + size_of_metadata) - size_of_metadata;
+    string expected = "";
+    for (int i = 0; i < count; i++) {
+        expected += "|U:" + to_string(batch_size);
+    }
+    expected += "||F:" + to_string(region_size) + "|";
+    if (smalloc_batch(batch_size - 3, count, array) != count) {
+        cout << "smalloc_batch didn't allocate the whole batch";
+    }
+    checkStats(0, 0, __LINE__);
+    for (int i = 0; i < count; i++) {
+        if ((size_t) array[i] % 8 != 0) {
+            cout << "batch allocation misaligned: " << to_string((size_t) array[i]);
+        }
+    }
+    printMemory(memory_start_addr, true);
+    sfree_batch(array, count);
+    checkStats(0, 0, __LINE__);
+    printMemory(memory_start_addr, true);
+    return expected;
+}
+
+// The bytes mapped for mmap'd blocks and the bytes of the mappings kept for reuse
+void mmapBytes(size_t &mapped, size_t &cached) {
+    MallocStats stats;
+    smalloc_stats(&stats);
+    mapped = stats.num_of_mmap_bytes;
+    cached = stats.num_of_cached_mmap_bytes;
+}
+
+TEST(testMmapCache) {
+    REQUIRE_MMAP_CACHE();
+    string expected = "";
+    size_t mapped, cached;
+    mmapBytes(mapped, cached);
+    const size_t base_mapped = mapped;
+    // A freed mapping is kept and handed to the next block of the same size
+    DO_MALLOC(array[0] = smalloc(size_for_mmap));
+    mmapBytes(mapped, cached);
+    const size_t length = mapped - base_mapped;
+    sfree(array[0]);
+    mmapBytes(mapped, cached);
+    if (mapped != base_mapped or cached != length) {
+        cout << "the freed mapping wasn't cached: " << to_string(cached);
+    }
+    DO_MALLOC(array[1] = smalloc(size_for_mmap));
+    mmapBytes(mapped, cached);
+    if (array[1] != array[0] or cached != 0 or mapped != base_mapped + length) {
+        cout << "the cached mapping wasn't reused";
+    }
+    // Mappings which weren't reused for MMAP_CACHE_MAX_AGE_MS are unmapped by the next use of the cache
+    sfree(array[1]);
+    usleep(1100 * 1000);
+    DO_MALLOC(array[2] = smalloc(8 * size_for_mmap));
+    mmapBytes(mapped, cached);
+    if (cached != 0) {
+        cout << "an old mapping was kept: " << to_string(cached);
+    }
+    sfree(array[2]);
+    // At most MMAP_CACHE_MAX_ENTRIES (16) mappings are kept, the oldest ones go first
+    for (int i = 0; i < 20; i++) {
+        DO_MALLOC(array[i] = smalloc(size_for_mmap));
+    }
+    for (int i = 0; i < 20; i++) {
+        sfree(array[i]);
+    }
+    mmapBytes(mapped, cached);
+    if (cached != 16 * length or mapped != base_mapped) {
+        cout << "the cache didn't keep the 16 newest mappings: " << to_string(cached);
+    }
+    // And at most MMAP_CACHE_MAX_BYTES (32MB): bigger mappings are unmapped right away, and the oldest mappings
+    // make room for new ones
+    const int big_size = 12 * 1024 * 1024;
+    DO_MALLOC(array[0] = smalloc(33 * 1024 * 1024));
+    sfree(array[0]);
+    mmapBytes(mapped, cached);
+    if (cached != 16 * length) {
+        cout << "a mapping past the size of the cache was kept";
+    }
+    for (int i = 0; i < 3; i++) {
+        DO_MALLOC(array[i] = smalloc(big_size));
+    }
+    mmapBytes(mapped, cached);
+    const size_t big_length = (mapped - base_mapped) / 3;
+    for (int i = 0; i < 3; i++) {
+        sfree(array[i]);
+    }
+    mmapBytes(mapped, cached);
+    if (cached != 2 * big_length) {
+        cout << "the cache went past its size: " << to_string(cached);
+    }
+    checkStats(0, 0, __LINE__);
+    return expected;
+}
+
+// Fills a block with a pattern which depends on the offset, so moved or cut data shows
+void fillPattern(void *p, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        ((unsigned char *) p)[i] = (unsigned char) (i * 7 + i / 4096);
+    }
+}
+
+bool checkPattern(void *p, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (((unsigned char *) p)[i] != (unsigned char) (i * 7 + i / 4096)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+TEST(testMmapRealloc) {
+    string expected = "";
+    size_t mapped, cached;
+    mmapBytes(mapped, cached);
+    const size_t base_mapped = mapped;
+    DO_MALLOC(array[0] = smalloc(4 * size_for_mmap));
+    fillPattern(array[0], 4 * size_for_mmap);
+    mmapBytes(mapped, cached);
+    const size_t long_length = mapped - base_mapped;
+    // Shrinking unmaps the tail of the mapping, which isn't worth caching
+    DO_MALLOC(array[1] = srealloc(array[0], 2 * size_for_mmap));
+    mmapBytes(mapped, cached);
+    const size_t short_length = mapped - base_mapped;
+    if (array[1] != array[0] or short_length >= long_length or short_length < (size_t) 2 * size_for_mmap or
+        cached != 0) {
+        cout << "the mapping wasn't cut in place: " << to_string(short_length);
+    }
+    if (!checkPattern(array[1], 2 * size_for_mmap)) {
+        cout << "shrinking lost the contents of the block";
+    }
+    // Growing back into the pages just unmapped keeps the block where it is
+    DO_MALLOC(array[2] = srealloc(array[1], 4 * size_for_mmap));
+    mmapBytes(mapped, cached);
+    if (array[2] != array[0] or mapped - base_mapped != long_length) {
+        cout << "the mapping didn't grow in place";
+    }
+    if (!checkPattern(array[2], 2 * size_for_mmap)) {
+        cout << "growing in place lost the contents of the block";
+    }
+    // With the page after its mapping taken, a block can't grow in place and its mapping moves
+    DO_MALLOC(array[3] = smalloc(size_for_mmap));
+    fillPattern(array[3], size_for_mmap);
+    mmapBytes(mapped, cached);
+    char *mapping_end = (char *) ((uintptr_t) array[3] & ~(uintptr_t) 4095) + mapped - base_mapped - long_length;
+    void *guard = mmap(mapping_end, 4096, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    bool blocked = guard == mapping_end or (guard == MAP_FAILED and errno == EEXIST);
+    DO_MALLOC(array[4] = srealloc(array[3], 4 * size_for_mmap));
+    mmapBytes(mapped, cached);
+    if (!blocked or array[4] == array[3] or mapped - base_mapped != 2 * long_length) {
+        cout << "the blocked mapping didn't move";
+    }
+    if (!checkPattern(array[4], size_for_mmap)) {
+        cout << "moving lost the contents of the block";
+    }
+    if (guard != MAP_FAILED) {
+        munmap(guard, 4096);
+    }
+    sfree(array[2]);
+    sfree(array[4]);
+    checkStats(0, 0, __LINE__);
+    return expected;
+}
+
+TEST(testHugePages) {
+#if defined(HUGE_PAGES) && HUGE_PAGES
+    string expected = "";
+    const size_t huge_page = 2 * 1024 * 1024;
+    const size_t base_huge = _num_huge_page_bytes();
+    // A fresh mapping is made of whole huge pages, all of them counted
+    DO_MALLOC(array[0] = smalloc(3 * huge_page / 2));
+    if (_num_huge_page_bytes() - base_huge != 2 * huge_page) {
+        cout << "a huge page mapping wasn't counted whole: " << to_string(_num_huge_page_bytes() - base_huge);
+    }
+    // Only the huge page aligned span inside a page aligned mapping, or one moved by mremap, is counted: 2 or 3 huge
+    // pages of each of these mappings
+    DO_MALLOC(array[1] = saligned_alloc(4096, 3 * huge_page));
+    DO_MALLOC(array[0] = srealloc(array[0], 5 * huge_page / 2));
+    size_t huge = _num_huge_page_bytes() - base_huge;
+    if (huge % huge_page != 0 or huge < 4 * huge_page or huge > 6 * huge_page) {
+        cout << "the huge pages of unaligned mappings are off: " << to_string(huge);
+    }
+    sfree(array[0]);
+    sfree(array[1]);
+    if (_num_huge_page_bytes() != base_huge) {
+        cout << "freed mappings are still counted: " << to_string(_num_huge_page_bytes() - base_huge);
+    }
+    return expected;
+#else
+    return skipped;
+#endif
+}
+
+TEST(testAligned) {
+    const int alignment = 256;
+    const int aligned_mmap_size = size_for_mmap + (8 - size_for_mmap % 8) % 8;
+    string expected = "";
+    DO_MALLOC(array[0] = saligned_alloc(alignment, 40));
+    checkStats(0, 0, __LINE__);
+    if ((size_t) array[0] % alignment != 0) {
+        cout << "aligned allocation misaligned: " << to_string((size_t) array[0]);
+    }
+    DO_MALLOC(array[1] = saligned_alloc(4096, size_for_mmap));
+    checkStats(aligned_mmap_size, 1, __LINE__);
+    if ((size_t) array[1] % 4096 != 0) {
+        cout << "aligned mmap allocation misaligned: " << to_string((size_t) array[1]);
+    }
+    if (sposix_memalign(&array[2], 3 * sizeof(void *), 40) != EINVAL) {
+        cout << "sposix_memalign accepted an alignment that isn't a power of two";
+    }
+    // Carving the alignment out of a heap block would pass the mmap threshold, so even a small block is mapped. From
+    // a second thread, whose arena's heap is a mapped segment
+    std::thread([array] { array[3] = saligned_alloc(1024 * 1024, 40); }).join();
+    if (!array[3] or (size_t) array[3] % (1024 * 1024) != 0) {
+        cout << "aligned allocation misaligned: " << to_string((size_t) array[3]);
+    }
+    checkStats(aligned_mmap_size + 40, 2, __LINE__);
+    sfree(array[3]);
+    sfree(array[0]);
+    checkStats(aligned_mmap_size, 1, __LINE__);
+    sfree(array[1]);
+    checkStats(0, 0, __LINE__);
+    return expected;
+}
+
+TEST(testExpand) {
+    REQUIRE_EXACT_LAYOUT();
+    const int merged_size = 104 + size_of_metadata + 296;
+    string expected = "|U:200|F:" + to_string(merged_size - 200 - size_of_metadata) + "|U:32|";
+    expected += "|U:" + to_string(merged_size) + "|U:32|";
+    DO_MALLOC(array[0] = smalloc(104));
+    DO_MALLOC(array[1] = smalloc(296));
+    DO_MALLOC(array[2] = smalloc(32));
+    sfree(array[1]);
+    checkStats(0, 0, __LINE__);
+    if (sexpand(array[0], 150, 200) != 200) {
+        cout << "sexpand didn't grow into the next block";
+    }
+    checkStats(0, 0, __LINE__);
+    printMemory(memory_start_addr, true);
+    if (sexpand(array[0], 1000, 1000) != 0) {
+        cout << "sexpand grew past an allocated block";
+    }
+    if (sexpand(array[0], 400, 400) != (size_t) merged_size) {
+        cout << "sexpand didn't take the whole next block";
+    }
+    checkStats(0, 0, __LINE__);
+    printMemory(memory_start_addr, true);
+    return expected;
+}
+
+TEST(testExpandLimits) {
+    REQUIRE_EXACT_LAYOUT();
+    const int max_heap_size = 128 * 1024 - 8;
+    string expected = "|U:64|F:64||U:64|F:64||U:" + to_string(max_heap_size) + "|";
+    DO_MALLOC(array[0] = smalloc(64));
+    DO_MALLOC(array[1] = smalloc(64));
+    sfree(array[1]);
+    printMemory(memory_start_addr, true);
+    // With the break moved by someone else the heap can't grow, and the free block after is left alone
+    if (sbrk(4096) == (void *) -1) {
+        cout << "sbrk failed";
+    }
+    if (sexpand(array[0], 1000, 1000) != 0) {
+        cout << "sexpand grew past the break";
+    }
+    checkStats(0, 0, __LINE__);
+    printMemory(memory_start_addr, true);
+    sbrk(-4096);
+    // Heap blocks never grow to the mmap threshold
+    if (sexpand(array[0], size_for_mmap, size_for_mmap) != 0) {
+        cout << "sexpand grew a heap block past the mmap threshold";
+    }
+    if (sexpand(array[0], 1000, size_for_mmap) != (size_t) max_heap_size) {
+        cout << "sexpand didn't grow up to the mmap threshold";
+    }
+    checkStats(0, 0, __LINE__);
+    printMemory(memory_start_addr, true);
+    return expected;
+}
+
+TEST(testUsableSize) {
+    REQUIRE_EXACT_LAYOUT();
+    string expected = "";
+    DO_MALLOC(array[0] = smalloc(104));
+    DO_MALLOC(array[1] = smalloc(32));
+    sfree(array[0]);
+    DO_MALLOC(array[0] = smalloc(80));
+    checkStats(0, 0, __LINE__);
+    if (smalloc_usable_size(array[0]) != 104) {
+        cout << "usable size doesn't include the unsplit slack: " << to_string(smalloc_usable_size(array[0]));
+    }
+    size_t actual = 0;
+    array[2] = smalloc_at_least(size_for_mmap, &actual);
+    if (actual < (size_t) size_for_mmap or ((size_t) array[2] + actual) % 4096 != 0) {
+        cout << "smalloc_at_least didn't hand out the whole mapping: " << to_string(actual);
+    }
+    if (smalloc_usable_size(array[2]) != actual) {
+        cout << "usable size doesn't match smalloc_at_least";
+    }
+    checkStats(actual, 1, __LINE__);
+    // A free heap block a little past the mmap threshold, which isn't split for a request just below it
+    const int max_heap_size = 128 * 1024 - 8;
+    DO_MALLOC(array[3] = smalloc(100000));
+    DO_MALLOC(array[4] = smalloc(max_heap_size + 64 - 100000 - size_of_metadata));
+    DO_MALLOC(array[5] = smalloc(32));
+    sfree(array[3]);
+    sfree(array[4]);
+    array[3] = smalloc_at_least(max_heap_size, &actual);
+    if (actual != (size_t) max_heap_size) {
+        cout << "smalloc_at_least handed out a heap block past the mmap threshold: " << to_string(actual);
+    }
+    checkStats(smalloc_usable_size(array[2]), 1, __LINE__);
+    return expected;
+}
+
+TEST(testSizedFree) {
+    string expected = "";
+    DO_MALLOC(array[0] = smalloc(64));
+    DO_MALLOC(array[1] = smalloc(100000));
+    DO_MALLOC(array[2] = smalloc(64));
+    sfree(array[2]);
+    // sexpand stops below the mmap threshold, so the size it returns still frees the block to the heap
+    size_t size = sexpand(array[1], 100000, 200000);
+    if (size < 100000 or size >= 128 * 1024) {
+        cout << "sexpand didn't grow the tail block up to the mmap threshold: " << to_string(size);
+    }
+    checkStats(0, 0, __LINE__);
+    sfree_sized(array[1], size);
+    checkStats(0, 0, __LINE__);
+    DO_MALLOC(array[1] = smalloc(64));
+    sfree_sized(array[1], 64);
+    sfree_sized(array[0], 64);
+    checkStats(0, 0, __LINE__);
+    DO_MALLOC(array[0] = smalloc(size_for_mmap));
+    checkStats((size_for_mmap + 7) & ~7, 1, __LINE__);
+    sfree_sized(array[0], size_for_mmap);
+    checkStats(0, 0, __LINE__);
+    return expected;
+}
+
+TEST(testStats) {
+    string expected = "";
+    MallocStats before, after;
+    smalloc_stats(&before);
+    // Bigger than the largest slab objects (1024 bytes), so they all come from the heap
+    DO_MALLOC(array[0] = smalloc(1500));
+    DO_MALLOC(array[1] = smalloc(2048));
+    DO_MALLOC(array[2] = smalloc(3000));
+    DO_MALLOC(array[3] = smalloc(2048));
+    sfree(array[0]);
+    sfree(array[2]);
+    checkStats(0, 0, __LINE__);
+    smalloc_stats(&after);
+    if (after.num_of_allocs - before.num_of_allocs != 4 or after.num_of_frees - before.num_of_frees != 2) {
+        cout << "cumulative counters are off";
+    }
+    size_t class_blocks = 0;
+    size_t class_bytes = 0;
+    for (int i = 0; i < SMALLOC_NUM_SIZE_CLASSES; i++) {
+        class_blocks += after.size_classes[i].num_of_free_blocks;
+        class_bytes += after.size_classes[i].num_of_free_bytes;
+    }
+    if (class_blocks != after.num_of_free_blocks or class_bytes != after.num_of_free_bytes or
+        after.num_of_free_blocks != _num_free_blocks()) {
+        cout << "size classes don't add up to the free blocks";
+    }
+    if (after.largest_free_block != 3000) {
+        cout << "largest free block is off: " << to_string(after.largest_free_block);
+    }
+    if (after.size_classes[4].num_of_free_blocks != 1 or after.size_classes[5].num_of_free_blocks != 1) {
+        cout << "free blocks are in the wrong size classes";
+    }
+    return expected;
+}
+
+struct walk_count_t {
+    size_t num_of_blocks;
+    size_t num_of_mmap_blocks;
+    size_t mmap_size;
+};
+
+// Free slab slots are spare room of their run rather than blocks
+void countBlock(const MallocBlockInfo *block, void *ctx) {
+    walk_count_t *count = (walk_count_t *) ctx;
+    if (block->origin == MALLOC_ORIGIN_SLAB and block->is_free) {
+        return;
+    }
+    count->num_of_blocks++;
+    if (block->origin == MALLOC_ORIGIN_MMAP) {
+        count->num_of_mmap_blocks++;
+        count->mmap_size = block->size;
+    }
+}
+
+TEST(testWalk) {
+    const int aligned_mmap_size = size_for_mmap + (8 - size_for_mmap % 8) % 8;
+    string expected = "";
+    DO_MALLOC(array[0] = smalloc(100));
+    DO_MALLOC(array[1] = smalloc(size_for_mmap));
+    checkStats(aligned_mmap_size, 1, __LINE__);
+    walk_count_t count = {0, 0, 0};
+    sheap_walk(countBlock, &count);
+    if (count.num_of_blocks != _num_allocated_blocks()) {
+        cout << "the walk didn't report every block: " << to_string(count.num_of_blocks);
+    }
+    if (count.num_of_mmap_blocks != 1 or count.mmap_size != (size_t) aligned_mmap_size) {
+        cout << "the walk didn't report the mmap'd block";
+    }
+    DO_MALLOC(array[1] = srealloc(array[1], 4 * size_for_mmap));
+    sfree(array[1]);
+    count = {0, 0, 0};
+    sheap_walk(countBlock, &count);
+    if (count.num_of_mmap_blocks != 0) {
+        cout << "the walk reported a freed mmap'd block";
+    }
+    return expected;
+}
+
+uint64_t readVarint(const string &data, size_t &offset) {
+    uint64_t value = 0;
+    for (int shift = 0; offset < data.size(); shift += 7) {
+        unsigned char byte = data[offset++];
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    return value;
+}
+
+TEST(testTrace) {
+    string expected = "";
+    char path[] = "/tmp/test4_traceXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return expected;
+    }
+    close(fd);
+    int result = smalloc_trace_start(path);
+#if !defined(ALLOC_TRACE) || !ALLOC_TRACE
+    unlink(path);
+    if (result != ENOSYS) {
+        cout << "tracing started in a build without it";
+        return expected;
+    }
+    return skipped;
+#else
+    if (result != 0) {
+        cout << "couldn't start tracing: " << to_string(result);
+        unlink(path);
+        return expected;
+    }
+    DO_MALLOC(array[0] = smalloc(100));
+    sfree(array[0]);
+    smalloc_trace_stop();
+    // Not recorded anymore
+    DO_MALLOC(array[1] = smalloc(200));
+    sfree(array[1]);
+    ifstream file(path, ios::binary);
+    string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    unlink(path);
+    size_t offset = strlen(SMALLOC_TRACE_MAGIC);
+    if (data.compare(0, offset, SMALLOC_TRACE_MAGIC) != 0) {
+        cout << "the trace doesn't start with the magic";
+        return expected;
+    }
+    // Both records are of the only thread, thread 0
+    uint64_t malloc_record[4], free_record[3];
+    if (data[offset++] != MALLOC_TRACE_MALLOC) {
+        cout << "the first record isn't the allocation";
+    }
+    for (uint64_t &value : malloc_record) {
+        value = readVarint(data, offset);
+    }
+    if (data[offset++] != MALLOC_TRACE_FREE) {
+        cout << "the second record isn't the free";
+    }
+    for (uint64_t &value : free_record) {
+        value = readVarint(data, offset);
+    }
+    if (malloc_record[0] != 0 or malloc_record[2] != 100 or malloc_record[3] != (uintptr_t) array[0]) {
+        cout << "wrong allocation record";
+    }
+    if (free_record[0] != 0 or free_record[1] < malloc_record[1] or free_record[2] != (uintptr_t) array[0]) {
+        cout << "wrong free record";
+    }
+    if (offset != data.size()) {
+        cout << "unexpected records after the free";
+    }
+    return expected;
+#endif
+}
+
+size_t countTimed(const MallocProfile &profile, MallocProfileTimer timer) {
+    size_t count = 0;
+    for (size_t calls : profile.cycles[timer]) {
+        count += calls;
+    }
+    return count;
+}
+
+// Bin i of a histogram only holds calls of at least 2^i cycles (bin 0 those of 0 or 1 cycle)
+bool checkHistogram(const MallocProfile &profile, MallocProfileTimer timer) {
+    size_t least_cycles = 0;
+    for (int bin = 1; bin < SMALLOC_PROFILE_NUM_BINS; bin++) {
+        least_cycles += profile.cycles[timer][bin] << bin;
+    }
+    bool timed = countTimed(profile, timer) != 0;
+    return profile.total_cycles[timer] >= least_cycles and (timed or profile.total_cycles[timer] == 0);
+}
+
+TEST(testProfile) {
+    string expected = "";
+    smalloc_profile_reset();
+    DO_MALLOC(array[0] = smalloc(100));
+    DO_MALLOC(array[1] = smalloc(100));
+    DO_MALLOC(array[2] = smalloc(100));
+    sfree(array[0]);
+    sfree(array[1]);
+    sfree(array[2]);
+    MallocProfile profile;
+    smalloc_profile(&profile);
+#if !defined(PROFILE_HOT_PATHS) || !PROFILE_HOT_PATHS
+    // Built without profiling, where nothing is counted
+    MallocProfile zeros = {};
+    if (profile.enabled or memcmp(profile.events, zeros.events, sizeof(zeros.events)) != 0 or
+        memcmp(profile.cycles, zeros.cycles, sizeof(zeros.cycles)) != 0) {
+        cout << "counted without profiling";
+        return expected;
+    }
+    return skipped;
+#else
+    if (not profile.enabled) {
+        cout << "the profile isn't enabled";
+    }
+    if (countTimed(profile, MALLOC_TIMER_MALLOC) != 3 or countTimed(profile, MALLOC_TIMER_FREE) != 3 or
+        countTimed(profile, MALLOC_TIMER_CALLOC) != 0 or countTimed(profile, MALLOC_TIMER_REALLOC) != 0) {
+        cout << "wrong number of timed calls";
+    }
+    // Every allocation searches the index once, and every free tries to merge
+    if (profile.events[MALLOC_EVENT_BLOCK_SEARCHES] != 3 or countTimed(profile, MALLOC_TIMER_BLOCK_SEARCH) != 3 or
+        countTimed(profile, MALLOC_TIMER_MERGE) != 3) {
+        cout << "wrong number of block searches or merges";
+    }
+    if (profile.events[MALLOC_EVENT_BUCKETS_SCANNED] < profile.events[MALLOC_EVENT_BLOCK_SEARCHES]) {
+        cout << "block searches scanned no buckets";
+    }
+    // The second free merges with the first block, and the third with both
+    if (profile.events[MALLOC_EVENT_MERGE_ATTEMPTS] != 3 or profile.events[MALLOC_EVENT_MERGES] < 2) {
+        cout << "wrong merge counts";
+    }
+    if (profile.events[MALLOC_EVENT_SBRK_CALLS] > 3 or profile.events[MALLOC_EVENT_MMAP_CALLS] != 0 or
+        profile.events[MALLOC_EVENT_MUNMAP_CALLS] != 0) {
+        cout << "wrong system call counts";
+    }
+    for (int timer = 0; timer < MALLOC_NUM_TIMERS; timer++) {
+        if (not checkHistogram(profile, (MallocProfileTimer) timer)) {
+            cout << "the histogram of timer " << timer << " doesn't add up to its cycles";
+        }
+    }
+    smalloc_profile_reset();
+    smalloc_profile(&profile);
+    if (profile.events[MALLOC_EVENT_MERGES] != 0 or countTimed(profile, MALLOC_TIMER_MALLOC) != 0 or
+        profile.total_cycles[MALLOC_TIMER_FREE] != 0) {
+        cout << "the profile wasn't reset";
+    }
+    return expected;
+#endif
+}
+
+TEST(testOptions) {
+    string expected = "";
+    if (smallopt(0, 8) != EINVAL or smallopt(SMALLOC_OPT_ALIGNMENT, 32) != EINVAL or
+        smallopt(SMALLOC_OPT_MMAP_THRESHOLD, 100) != EINVAL or smallopt(SMALLOC_OPT_MAX_SIZE, 0) != EINVAL) {
+        cout << "accepted an invalid option";
+    }
+    // The earlier tests allocated, so the parameters are fixed by now
+    if (smallopt(SMALLOC_OPT_MMAP_THRESHOLD, 256 * 1024) != EBUSY) {
+        cout << "changed an option after allocating";
+    }
+    DO_MALLOC(array[0] = smalloc(size_for_mmap));
+    MallocStats stats;
+    smalloc_stats(&stats);
+    if (stats.num_of_mmap_bytes == 0) {
+        cout << "the mmap threshold changed";
+    }
+    sfree(array[0]);
+    return expected;
+}
+
+const int stress_threads = 8;
+const int stress_blocks = 64;
+const int stress_rounds = 4000;
+
+struct stress_block_t {
+    void *p;
+    size_t size;
+    unsigned char seed;
+};
+
+stress_block_t stress_table[stress_threads][stress_blocks];
+std::atomic<size_t> stress_allocs, stress_frees, stress_reallocs, stress_errors;
+
+// Mostly small and medium blocks, and now and then one big enough to be mapped
+size_t stressSize(unsigned int *state) {
+    unsigned int roll = rand_r(state) % 100;
+    if (roll < 60) {
+        return 1 + rand_r(state) % 512;
+    }
+    return roll < 97 ? 513 + rand_r(state) % (16 * 1024) : size_for_mmap + rand_r(state) % (4 * size_for_mmap);
+}
+
+void fillStressBlock(stress_block_t &block) {
+    for (size_t i = 0; i < block.size; i++) {
+        ((unsigned char *) block.p)[i] = (unsigned char) (block.seed + i);
+    }
+}
+
+// Checks the first `size` bytes of the block still hold its pattern
+void checkStressBlock(const stress_block_t &block, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (((unsigned char *) block.p)[i] != (unsigned char) (block.seed + i)) {
+            stress_errors++;
+            return;
+        }
+    }
+}
+
+// Allocates, frees and reallocates the blocks of a row of the table, which other threads may have allocated
+void stressRow(int row, unsigned int seed, int rounds) {
+    unsigned int state = seed;
+    for (int round = 0; round < rounds; round++) {
+        stress_block_t &block = stress_table[row][rand_r(&state) % stress_blocks];
+        if (!block.p) {
+            block.size = stressSize(&state);
+            block.seed = (unsigned char) rand_r(&state);
+            block.p = rand_r(&state) % 4 ? smalloc(block.size) : scalloc(1, block.size);
+            if (!block.p) {
+                stress_errors++;
+                continue;
+            }
+            stress_allocs++;
+            fillStressBlock(block);
+        } else if (rand_r(&state) % 2) {
+            checkStressBlock(block, block.size);
+            sfree(block.p);
+            stress_frees++;
+            block.p = nullptr;
+        } else {
+            size_t size = stressSize(&state);
+            void *p = srealloc(block.p, size);
+            if (!p) {
+                stress_errors++;
+                continue;
+            }
+            stress_reallocs++;
+            block.p = p;
+            checkStressBlock(block, min(block.size, size));
+            block.size = size;
+            fillStressBlock(block);
+        }
+    }
+}
+
+struct walk_stats_t {
+    size_t allocated_blocks;
+    size_t allocated_bytes;
+    size_t free_blocks;
+    size_t free_bytes;
+};
+
+// Free slab slots are spare room of their run rather than free blocks
+void sumBlock(const MallocBlockInfo *block, void *ctx) {
+    walk_stats_t *sum = (walk_stats_t *) ctx;
+    if (!block->is_free) {
+        sum->allocated_blocks++;
+        sum->allocated_bytes += block->size;
+    } else if (block->origin != MALLOC_ORIGIN_SLAB) {
+        sum->free_blocks++;
+        sum->free_bytes += block->size;
+    }
+}
+
+void checkStressStats(const MallocStats &before, int line_number) {
+    MallocStats stats;
+    smalloc_stats(&stats);
+    walk_stats_t sum = {0, 0, 0, 0};
+    sheap_walk(sumBlock, &sum);
+    if (sum.allocated_blocks != stats.num_of_allocated_blocks or sum.allocated_bytes != stats.num_of_allocated_bytes or
+        sum.free_blocks != stats.num_of_free_blocks or sum.free_bytes != stats.num_of_free_bytes) {
+        cout << "the stats don't match the blocks of the heap at line: " << line_number << endl;
+    }
+    if (stats.num_of_allocs - before.num_of_allocs != stress_allocs or
+        stats.num_of_frees - before.num_of_frees != stress_frees or
+        stats.num_of_reallocs - before.num_of_reallocs != stress_reallocs) {
+        cout << "cumulative counters are off at line: " << line_number << endl;
+    }
+    if (stats.num_of_allocated_blocks - before.num_of_allocated_blocks != stress_allocs - stress_frees) {
+        cout << "the blocks in use are off at line: " << line_number << endl;
+    }
+}
+
+TEST(testThreads) {
+    string expected = "";
+    MallocStats before;
+    smalloc_stats(&before);
+    // Every thread works on its own row first, then frees and reallocates the blocks of the next thread's row, which
+    // were allocated from another arena
+    for (int phase = 0; phase < 2; phase++) {
+        std::thread threads[stress_threads];
+        for (int i = 0; i < stress_threads; i++) {
+            threads[i] = std::thread(stressRow, (i + phase) % stress_threads, i * 2 + phase + 1, stress_rounds);
+        }
+        for (int i = 0; i < stress_threads; i++) {
+            threads[i].join();
+        }
+        checkStressStats(before, __LINE__);
+    }
+    // Freed by a thread of its own, whose cache is given back when it exits
+    std::thread([] {
+        for (int row = 0; row < stress_threads; row++) {
+            for (int i = 0; i < stress_blocks; i++) {
+                if (stress_table[row][i].p) {
+                    checkStressBlock(stress_table[row][i], stress_table[row][i].size);
+                    sfree(stress_table[row][i].p);
+                    stress_frees++;
+                }
+            }
+        }
+    }).join();
+    checkStressStats(before, __LINE__);
+    if (stress_errors) {
+        cout << "blocks were corrupted or couldn't be allocated: " << stress_errors;
+    }
+    return expected;
+}
+
+// A thread specific value whose destructor frees a block, after the one giving back the thread's cache
+void freeAtExit(void *p) {
+    sfree(p);
+}
+
+TEST(testCacheExit) {
+    string expected = "";
+    MallocStats before, after;
+    smalloc_stats(&before);
+    std::thread([] {
+        // The first free registers the cache's destructor, so the key created next is destroyed after it
+        sfree(smalloc(64));
+        pthread_key_t key;
+        pthread_key_create(&key, freeAtExit);
+        pthread_setspecific(key, smalloc(64));
+    }).join();
+    smalloc_stats(&after);
+    if (after.num_of_allocated_blocks != before.num_of_allocated_blocks) {
+        cout << "a block freed after the thread's cache was given back is stuck in it";
+    }
+    return expected;
+}
+
+static int new_handler_calls = 0;
+
+// Can't free anything, so it gives up for the next attempt
+void giveUpHandler() {
+    new_handler_calls++;
+    set_new_handler(nullptr);
+}
+
+TEST(testOperatorNew) {
+#if REPLACE_OPERATOR_NEW
+    string expected = "";
+    struct alignas(4096) Page {
+        char byte;
+    };
+    MallocStats before, after;
+    smalloc_stats(&before);
+    int *value = new int(1);
+    char *empty = new char[0];
+    Page *page = new Page;
+    void *mapped = ::operator new(size_for_mmap);
+    smalloc_stats(&after);
+    if (after.num_of_allocs - before.num_of_allocs != 4 or
+        after.num_of_allocated_blocks - before.num_of_allocated_blocks != 4) {
+        cout << "operator new didn't allocate with smalloc";
+    }
+    if (!empty or (uintptr_t) page % 4096 != 0) {
+        cout << "operator new handed out a null or misaligned block";
+    }
+    // The sized overloads free a mapped block from its size alone
+    delete value;
+    delete[] empty;
+    delete page;
+    ::operator delete(mapped, size_for_mmap);
+    smalloc_stats(&after);
+    if (after.num_of_frees - before.num_of_frees != 4 or
+        after.num_of_allocated_blocks != before.num_of_allocated_blocks) {
+        cout << "operator delete didn't free with sfree";
+    }
+    // Too big for MAX_SIZE, so only the new handler could help
+    volatile size_t huge = SIZE_MAX / 2;
+    set_new_handler(giveUpHandler);
+    if (new(nothrow) char[huge] or new_handler_calls != 1) {
+        cout << "the nothrow operator new didn't give up with the new handler";
+    }
+#ifdef __cpp_exceptions
+    bool thrown = false;
+    try {
+        ::operator new(huge);
+    } catch (const bad_alloc &) {
+        thrown = true;
+    }
+    if (not thrown) {
+        cout << "operator new didn't throw when out of memory";
+    }
+#else
+    // Without exceptions the throwing overloads abort
+    pid_t pid = fork();
+    if (pid == 0) {
+        set_new_handler(giveUpHandler);
+        ::operator new(huge);
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (not WIFSIGNALED(status) or WTERMSIG(status) != SIGABRT) {
+        cout << "operator new didn't abort when out of memory";
+    }
+#endif
+    return expected;
+#else
+    return skipped;
+#endif
+}
+
 /////////////////////////////////////////////////////
 
 #ifdef USE_COLORS
 #define PRED(x) FRED(x)
 #define PGRN(x) FGRN(x)
+#define PYEL(x) FYEL(x)
 #endif
 #ifndef USE_COLORS
 #define PRED(x) x
 #define PGRN(x) x
+#define PYEL(x) x
 #endif
 
 void *getMemoryStart() {
+    // Small allocations may be slab objects, which aren't in the heap
+#if defined(SLAB_MAX_SIZE) && SLAB_MAX_SIZE > 0
+    void *first = smalloc(SLAB_MAX_SIZE + 1);
+#else
     void *first = smalloc(1);
+#endif
     if (!first) { return nullptr; }
     void *start = (char *) first - _size_meta_data();
     sfree(first);
@@ -300,7 +1217,10 @@ bool checkFunc(std::string (*func)(void *[MAX_ALLOC]), void *array[MAX_ALLOC], s
     int result = text.compare(expected);
     // Restore original buffer before exiting
     std::cout.rdbuf(prevcoutbuf);
-    if (result != 0) {
+    if (expected == skipped) {
+        printTestName(test_name);
+        std::cout << ": " << PYEL("SKIP") << std::endl;
+    } else if (result != 0) {
         printTestName(test_name);
         std::cout << ": " << PRED("FAIL") << std::endl;
         std::cout << "expected: '" << expected << "\'" << std::endl;
@@ -316,11 +1236,17 @@ bool checkFunc(std::string (*func)(void *[MAX_ALLOC]), void *array[MAX_ALLOC], s
 }
 /////////////////////////////////////////////////////
 
-TestFunc functions[] = {testInit, testAlignSanity, testAlignSplit, testAlignMmap, testAlignCalloc, testAlignRealloc, NULL};
-std::string function_names[] = {"testInit", "testAlignSanity", "testAlignSplit", "testAlignMmap", "testAlignCalloc", "testAlignRealloc"};
+#if REPLACE_OPERATOR_NEW
+// The strings and streams of the tests are in the heap too once operator new is replaced, so only its own test runs
+TestFunc functions[] = {testOperatorNew, NULL};
+std::string function_names[] = {"testOperatorNew"};
+#else
+TestFunc functions[] = {testInit, testAlignSanity, testAlignSplit, testAlignMmap, testAlignCalloc, testCallocZeroed, testAlignRealloc, testTrim, testMmapCache, testMmapRealloc, testHugePages, testBatch, testAligned, testExpand, testExpandLimits, testUsableSize, testSizedFree, testStats, testWalk, testTrace, testProfile, testOptions, testThreads, testCacheExit, testOperatorNew, NULL};
+std::string function_names[] = {"testInit", "testAlignSanity", "testAlignSplit", "testAlignMmap", "testAlignCalloc", "testCallocZeroed", "testAlignRealloc", "testTrim", "testMmapCache", "testMmapRealloc", "testHugePages", "testBatch", "testAligned", "testExpand", "testExpandLimits", "testUsableSize", "testSizedFree", "testStats", "testWalk", "testTrace", "testProfile", "testOptions", "testThreads", "testCacheExit", "testOperatorNew"};
+#endif
 
 void checkStats(size_t bytes_mmap, int blocks_mmap, int line_number) {
-    updateStats<MallocMetadata>(memory_start_addr, current_stats, bytes_mmap, blocks_mmap);
+    updateStats(memory_start_addr, current_stats, bytes_mmap, blocks_mmap);
     if (_num_allocated_blocks() != current_stats.num_allocated_blocks) {
         std::cout << "num_allocated_blocks is not accurate at line: " << line_number << std::endl;
         std::cout << "Expected: " << current_stats.num_allocated_blocks << std::endl;